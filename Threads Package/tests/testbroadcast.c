@@ -0,0 +1,143 @@
+//
+// Check thread_cond_broadcast() on four workers. Waiters take a ticket
+// under the mutex before waiting, so tickets give the order they queued
+// on the condition variable. One broadcast has to wake every one of them,
+// each returning from thread_cond_wait() holding the mutex, in ticket
+// order. Trials alternate between broadcasting with the mutex held, when
+// no waiter may run before the main thread unlocks it, and with it free,
+// when the first waiter gets it at once.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// CS520 threads
+#include "thread.h"
+
+// number of workers to run threads on
+#define WORKERS 4
+
+// number of waiters per trial, and of trials
+#define THREADS 20
+#define TRIALS 500
+
+// seconds to wait for the waiters of a trial before giving up
+#define TIMEOUT 10
+
+// mutex and condition variable the threads wait on
+thread_mutex_t mu;
+thread_cond_t cv;
+
+// tickets handed out, waiters woken, and waiters holding the mutex, all
+// guarded by mu
+int tickets;
+int woken;
+int inside;
+
+// counter for exiting threads
+int cnt;
+
+// local function prototypes
+void error(char *);
+void waiter(void *);
+
+int main(void)
+{
+   int trial;
+   long i;
+   time_t start;
+
+   if (thread_set_workers(WORKERS) == 0)
+      error("can't set the number of workers");
+   if (thread_mutex_init(&mu) == 0)
+      error("can't init mutex");
+   if (thread_cond_init(&cv) == 0)
+      error("can't init condition variable");
+
+   for (trial = 0; trial < TRIALS; trial++)
+   {
+      int held = trial % 2 == 0;
+      tickets = woken = 0;
+      __atomic_store_n(&cnt, 0, __ATOMIC_SEQ_CST);
+
+      for (i = 0; i < THREADS; i++)
+      {
+         if (thread_create(waiter, 0) == 0)
+            error("error in thread create");
+      }
+
+      // all have queued once all have tickets and the mutex is ours
+      for (;;)
+      {
+         if (thread_mutex_lock(&mu) == 0)
+            error("error in mutex_lock in main thread");
+         if (tickets == THREADS)
+            break;
+         if (thread_mutex_unlock(&mu) == 0)
+            error("error in mutex_unlock in main thread");
+         thread_yield();
+      }
+
+      if (!held && thread_mutex_unlock(&mu) == 0)
+         error("error in mutex_unlock in main thread");
+      if (thread_cond_broadcast(&cv) == 0)
+         error("error in cond_broadcast");
+      if (held)
+      {
+         for (i = 0; i < 10; i++)
+            thread_yield();
+         if (woken != 0)
+            error("a waiter ran while the broadcaster held the mutex");
+         if (thread_mutex_unlock(&mu) == 0)
+            error("error in mutex_unlock in main thread");
+      }
+
+      start = time(NULL);
+      while (__atomic_load_n(&cnt, __ATOMIC_SEQ_CST) != THREADS)
+      {
+         if (time(NULL) - start > TIMEOUT)
+            error("a broadcast did not wake every waiter");
+         thread_yield();
+      }
+   }
+
+   // nobody is left waiting, so a broadcast now is a no-op
+   if (thread_cond_broadcast(&cv) == 0)
+      error("error in cond_broadcast");
+
+   printf("%d broadcasts woke %d waiters each, in order, holding the mutex\n",
+          TRIALS, THREADS);
+   return 0;
+}
+
+void waiter(void *in)
+{
+   int ticket, k;
+
+   if (thread_mutex_lock(&mu) == 0)
+      error("error in mutex_lock");
+   ticket = tickets++;
+   if (thread_cond_wait(&cv, &mu) == 0)
+      error("error in cond_wait");
+
+   // woken holding the mutex: nobody else is inside, and it is our turn
+   if (inside++ != 0)
+      error("a woken waiter did not hold the mutex");
+   if (ticket != woken)
+      error("waiters were woken out of order");
+   woken++;
+   for (k = 0; k < 3; k++)
+      thread_yield();
+   inside--;
+
+   if (thread_mutex_unlock(&mu) == 0)
+      error("a woken waiter could not unlock the mutex");
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
@@ -0,0 +1,125 @@
+//
+// Check that mutexes and condition variables hand over in the order
+// threads started waiting. Threads queue one at a time, on a mutex the
+// main thread holds and then on a condition variable, and have to get the
+// mutex, or be woken by one signal each, first come first served. It runs
+// on one worker without preemption, so each thread runs until it blocks.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// CS520 threads
+#include "thread.h"
+
+// number of threads to queue
+#define THREADS 100
+
+// mutex and condition variable the threads wait on
+thread_mutex_t mu;
+thread_cond_t cv;
+
+// the last thread to start waiting, the order they were served in, and
+// the number served
+volatile long arrived;
+long order[THREADS];
+int served;
+
+// local function prototypes
+void error(char *);
+void lockWaiter(void *);
+void condWaiter(void *);
+void queueAll(void (*)(void *));
+void checkOrder(char *);
+
+int main(void)
+{
+   int i;
+
+   if (thread_set_workers(1) == 0 || thread_set_quantum(0) == 0)
+      error("can't set up the threads package");
+   if (thread_mutex_init(&mu) == 0)
+      error("can't init mutex");
+   if (thread_cond_init(&cv) == 0)
+      error("can't init condition variable");
+
+   if (thread_mutex_lock(&mu) == 0)
+      error("error in mutex_lock in main thread");
+   queueAll(lockWaiter);
+   if (thread_mutex_unlock(&mu) == 0)
+      error("error in mutex_unlock in main thread");
+   while (served != THREADS)
+      thread_yield();
+   checkOrder("mutex");
+
+   served = 0;
+   arrived = 0;
+   queueAll(condWaiter);
+   for (i = 0; i < THREADS; i++)
+   {
+      if (thread_cond_signal(&cv) == 0)
+         error("error in cond_signal");
+      while (served != i + 1)
+         thread_yield();
+   }
+   checkOrder("condition variable");
+
+   printf("%d threads served in order by a mutex and a condition variable\n",
+          THREADS);
+   return 0;
+}
+
+void lockWaiter(void *in)
+{
+   arrived = (long) in;
+   if (thread_mutex_lock(&mu) == 0)
+      error("error in mutex_lock");
+   order[served++] = (long) in;
+   if (thread_mutex_unlock(&mu) == 0)
+      error("error in mutex_unlock");
+}
+
+void condWaiter(void *in)
+{
+   if (thread_mutex_lock(&mu) == 0)
+      error("error in mutex_lock");
+   arrived = (long) in;
+   if (thread_cond_wait(&cv, &mu) == 0)
+      error("error in cond_wait");
+   order[served++] = (long) in;
+   if (thread_mutex_unlock(&mu) == 0)
+      error("error in mutex_unlock");
+}
+
+// creates the threads one at a time, each after the last has blocked
+void queueAll(void (*waiter)(void *))
+{
+   long i;
+
+   for (i = 1; i <= THREADS; i++)
+   {
+      if (thread_create(waiter, (void *) i) == 0)
+         error("error in thread create");
+      while (arrived != i)
+         thread_yield();
+   }
+}
+
+void checkOrder(char *what)
+{
+   int i;
+
+   for (i = 0; i < THREADS; i++)
+      if (order[i] != i + 1)
+      {
+         fprintf(stderr, "%s served thread %ld in place %d\n", what, order[i],
+                 i + 1);
+         exit(-1);
+      }
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
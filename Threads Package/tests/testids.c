@@ -0,0 +1,90 @@
+//
+// Create and run 2,000,000 short lived threads, a thousand at a time.
+// Each thread's ID has to be what thread_self() returns inside it, TCBs
+// have to be reused rather than allocated anew, and an ID of a reused TCB
+// has to differ from every ID it had before, so a stale ID never names a
+// newer thread.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// CS520 threads
+#include "thread.h"
+
+// threads alive at once, and how many times they are recreated
+#define THREADS 1000
+#define ROUNDS 2000
+
+// TCBs that may ever be allocated: those of one round, and some slack
+#define MAXINDEX (2 * THREADS)
+
+// counter for exiting threads
+int cnt;
+
+// the IDs of this round's threads, from thread_create() and thread_self()
+long created[THREADS];
+long self[THREADS];
+
+// the last generation seen for each TCB
+unsigned int generation[MAXINDEX + 1];
+
+// local function prototypes
+void error(char *);
+void work(void *);
+
+int main(void)
+{
+   long i;
+   int r, reused = 0;
+   long me = thread_self();
+
+   for (r = 0; r < ROUNDS; r++)
+   {
+      cnt = 0;
+      for (i = 0; i < THREADS; i++)
+      {
+         if ((created[i] = thread_create(work, (void *) i)) == 0)
+            error("error in thread create");
+      }
+      while (__atomic_load_n(&cnt, __ATOMIC_SEQ_CST) != THREADS)
+         thread_yield();
+
+      for (i = 0; i < THREADS; i++)
+      {
+         unsigned long index = created[i] & 0xffffffff;
+         unsigned int gen = (unsigned long) created[i] >> 32;
+         if (self[i] != created[i])
+            error("thread_self() is not the ID thread_create() returned");
+         if (index > MAXINDEX)
+            error("TCBs are not being reused");
+         if (generation[index])
+         {
+            if (gen <= generation[index])
+               error("a reused TCB got an ID it had before");
+            reused++;
+         }
+         generation[index] = gen;
+      }
+   }
+
+   if (thread_self() != me)
+      error("the main thread's ID changed");
+
+   printf("%d threads created, %d on reused TCBs with new IDs\n",
+          THREADS * ROUNDS, reused);
+   return 0;
+}
+
+void work(void *in)
+{
+   long i = (long) in;
+   self[i] = thread_self();
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
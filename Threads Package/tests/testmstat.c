@@ -0,0 +1,168 @@
+//
+// Check the counts thread_mutex_stats() reports. On one worker without
+// preemption a thread that finds the mutex held always parks, as its owner
+// is never running, so every count is known: uncontended locks, locks that
+// parked behind the main thread, and the mutex taken back at the end of
+// thread_cond_wait(), parked when the signaller held it and not when it
+// was free. Then threads fight over it holding it across yields, so every
+// lock but the first finds it held and parks.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// CS520 threads
+#include "thread.h"
+
+// threads fighting over the mutex, and how often each locks it
+#define THREADS 8
+#define LOCKS 1000
+
+// mutex whose counts are checked, and the condition variable waited on
+thread_mutex_t mu;
+thread_cond_t cv;
+
+// counter for exiting threads, and for waiters about to wait
+int cnt;
+int waiting;
+
+// local function prototypes
+void error(char *);
+void expect(unsigned long, unsigned long, unsigned long, char *);
+void locker(void *);
+void waiter(void *);
+void fighter(void *);
+void waitFor(int *, int);
+
+int main(void)
+{
+   thread_mutex_stats_t stats;
+   thread_mutex_t unused = { 0 };
+   int i;
+
+   if (thread_set_workers(1) == 0 || thread_set_quantum(0) == 0)
+      error("can't set up the threads package");
+   if (thread_mutex_stats(&unused, &stats) != 0 ||
+       thread_mutex_stats(NULL, &stats) != 0)
+      error("stats of a mutex that was never initialized");
+   if (thread_mutex_init(&mu) == 0)
+      error("can't init mutex");
+   if (thread_cond_init(&cv) == 0)
+      error("can't init condition variable");
+   expect(0, 0, 0, "a new mutex");
+
+   // locking a mutex the caller already holds is not counted
+   for (i = 0; i < 3; i++)
+   {
+      thread_mutex_lock(&mu);
+      thread_mutex_lock(&mu);
+      thread_mutex_unlock(&mu);
+   }
+   expect(3, 0, 0, "uncontended locks");
+
+   // two threads park behind the main thread and get it handed over
+   thread_mutex_lock(&mu);
+   for (i = 0; i < 2; i++)
+   {
+      if (thread_create(locker, 0) == 0)
+         error("error in thread create");
+   }
+   thread_yield();
+   thread_mutex_unlock(&mu);
+   waitFor(&cnt, 2);
+   expect(6, 0, 2, "locks that parked");
+
+   // signalled while the main thread holds the mutex, the waiter queues
+   // for it and is handed it on unlock
+   if (thread_create(waiter, 0) == 0)
+      error("error in thread create");
+   waitFor(&waiting, 1);
+   thread_mutex_lock(&mu);
+   thread_cond_signal(&cv);
+   thread_mutex_unlock(&mu);
+   waitFor(&cnt, 3);
+   expect(9, 0, 3, "a cond wait woken by a holder of the mutex");
+
+   // signalled while the mutex is free, the waiter gets it at once
+   if (thread_create(waiter, 0) == 0)
+      error("error in thread create");
+   waitFor(&waiting, 2);
+   thread_cond_signal(&cv);
+   waitFor(&cnt, 4);
+   expect(11, 0, 3, "a cond wait woken with the mutex free");
+
+   // only the first lock finds the mutex free, the holder keeps it held
+   // until it hands it to the next in the queue
+   for (i = 0; i < THREADS; i++)
+   {
+      if (thread_create(fighter, 0) == 0)
+         error("error in thread create");
+   }
+   waitFor(&cnt, 4 + THREADS);
+   expect(11 + THREADS * LOCKS, 0, 3 + THREADS * LOCKS - 1, "contention");
+   thread_mutex_stats(&mu, &stats);
+
+   printf("%lu locks counted, %lu of them parked\n", stats.locks,
+          stats.parked);
+   return 0;
+}
+
+// checks the mutex's counts, naming what was just done if they are off
+void expect(unsigned long locks, unsigned long spun, unsigned long parked,
+            char *after)
+{
+   thread_mutex_stats_t stats;
+
+   if (thread_mutex_stats(&mu, &stats) == 0)
+      error("error in mutex_stats");
+   if (stats.locks != locks || stats.spun != spun || stats.parked != parked)
+   {
+      fprintf(stderr, "after %s: %lu locks, %lu spun, %lu parked, "
+              "expected %lu, %lu, %lu\n", after, stats.locks, stats.spun,
+              stats.parked, locks, spun, parked);
+      exit(-1);
+   }
+}
+
+void locker(void *in)
+{
+   thread_mutex_lock(&mu);
+   thread_mutex_unlock(&mu);
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+void waiter(void *in)
+{
+   thread_mutex_lock(&mu);
+   __atomic_add_fetch(&waiting, 1, __ATOMIC_SEQ_CST);
+   if (thread_cond_wait(&cv, &mu) == 0)
+      error("error in cond_wait");
+   thread_mutex_unlock(&mu);
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+void fighter(void *in)
+{
+   int i;
+
+   for (i = 0; i < LOCKS; i++)
+   {
+      thread_mutex_lock(&mu);
+      thread_yield();
+      thread_mutex_unlock(&mu);
+   }
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+// yields until *counter reaches n
+void waitFor(int *counter, int n)
+{
+   while (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != n)
+      thread_yield();
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
@@ -0,0 +1,98 @@
+//
+// Check that thread_preempt_disable() sections nest. With another thread
+// ready, the main thread spins for several quanta inside two nested
+// sections, and inside one around library calls that have sections of
+// their own, and the other thread must not run until the outermost section
+// ends. The preemption that came meanwhile is then taken at once.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// CS520 threads
+#include "thread.h"
+
+// us a thread runs before it is preempted
+#define QUANTUM 10000
+
+// ms spun in each section, several quanta
+#define SPIN 50
+
+// mutex locked inside a section
+thread_mutex_t mu;
+
+// set by a thread once it has run
+volatile int ran;
+
+// local function prototypes
+void error(char *);
+void work(void *);
+void spin(long);
+long cpuMs(void);
+
+int main(void)
+{
+   if (thread_set_workers(1) == 0 || thread_set_quantum(QUANTUM) == 0)
+      error("can't set up the threads package");
+   if (thread_mutex_init(&mu) == 0)
+      error("can't init mutex");
+
+   if (thread_create(work, 0) == 0)
+      error("error in thread create");
+   thread_preempt_disable();
+   thread_preempt_disable();
+   spin(SPIN);
+   if (ran)
+      error("preempted inside two sections");
+   thread_preempt_enable();
+   spin(SPIN);
+   if (ran)
+      error("preempted when only the inner section had ended");
+   thread_preempt_enable();
+   if (!ran)
+      error("the preemption was not taken when the sections ended");
+
+   ran = 0;
+   if (thread_create(work, 0) == 0)
+      error("error in thread create");
+   thread_preempt_disable();
+   if (thread_mutex_lock(&mu) == 0 || thread_mutex_unlock(&mu) == 0)
+      error("error in mutex lock or unlock");
+   spin(SPIN);
+   if (ran)
+      error("a library call ended the caller's section");
+   thread_preempt_enable();
+   if (!ran)
+      error("the preemption was not taken when the section ended");
+
+   printf("no preemption inside nested sections, taken when they ended\n");
+   return 0;
+}
+
+void work(void *in)
+{
+   ran = 1;
+}
+
+// uses up ms of cpu time without yielding
+void spin(long ms)
+{
+   long start = cpuMs();
+   while (cpuMs() - start < ms)
+      ;
+}
+
+// returns the cpu time of the calling kernel thread, in ms
+long cpuMs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
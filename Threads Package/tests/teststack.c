@@ -0,0 +1,190 @@
+//
+// Check thread stacks: sizes below the minimum are refused, threads
+// created with other sizes can use nearly all of the stack they asked
+// for, default stacks are recycled rather than mapped anew, which is seen
+// from a mark left on them surviving, as new pages come zeroed, and running
+// off the end of a stack faults in the guard page below it. It runs on one
+// worker, whose own free list every stack goes back to, and preemption is
+// off, so no signal frame lands on a stack that is nearly full.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// CS520 threads
+#include "thread.h"
+
+// stack sizes to try, one not a whole number of pages
+unsigned long sizes[] = { 16 << 10, 100000, 1 << 20, 8 << 20 };
+#define SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// bytes of a stack left untouched, for the frames above the thread's
+// function and the last page touched
+#define SLACK (8 << 10)
+
+// default threads alive at once, and how many times they are recreated
+#define THREADS 100
+#define ROUNDS 20
+
+// written on a stack by each default thread
+#define MARK 0x5eed5eed5eedL
+
+// counter for exiting threads, and for those that found a mark
+int cnt;
+int reused;
+
+// where the overflowing thread started, and the size of its stack
+char *top;
+unsigned long overflowSize;
+
+// local function prototypes
+void error(char *);
+void deep(void *);
+void touch(char *, unsigned long);
+void recycled(void *);
+void overflow(void *);
+void recurse(int);
+void fault(int, siginfo_t *, void *);
+void waitFor(int);
+
+int main(void)
+{
+   thread_attr_t attr;
+   int i, j, status;
+   pid_t pid;
+
+   if (thread_set_workers(1) == 0)
+      error("can't set the number of workers");
+   if (thread_set_quantum(0) == 0)
+      error("can't turn preemption off");
+   if (thread_attr_init(&attr) == 0)
+      error("can't init attributes");
+   if (thread_attr_setstacksize(&attr, 4096) != 0)
+      error("a stack below the minimum was accepted");
+   if (thread_attr_setstacksize(NULL, 1 << 20) != 0)
+      error("a NULL attribute was accepted");
+
+   // each thread fills all but SLACK bytes of its stack
+   for (i = 0; i < SIZES; i++)
+   {
+      if (thread_attr_setstacksize(&attr, sizes[i]) == 0)
+         error("can't set the stack size");
+      if (thread_create_attr(deep, (void *) sizes[i], &attr) == 0)
+         error("error in thread create");
+   }
+   waitFor(SIZES);
+
+   // every round's threads should get the stacks of the round before
+   for (i = 0; i < ROUNDS; i++)
+   {
+      cnt = 0;
+      for (j = 0; j < THREADS; j++)
+      {
+         if (thread_create(recycled, 0) == 0)
+            error("error in thread create");
+      }
+      waitFor(THREADS);
+   }
+   if (reused != THREADS * (ROUNDS - 1))
+      error("default stacks were not recycled");
+
+   // a thread that recurses without end has to fault in its guard page
+   fflush(stdout);
+   pid = fork();
+   if (pid == 0)
+   {
+      stack_t alt;
+      struct sigaction sa;
+      alt.ss_sp = malloc(SIGSTKSZ);
+      alt.ss_size = SIGSTKSZ;
+      alt.ss_flags = 0;
+      sigaltstack(&alt, NULL);
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = fault;
+      sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+      sigaction(SIGSEGV, &sa, NULL);
+
+      overflowSize = 16 << 10;
+      thread_attr_setstacksize(&attr, overflowSize);
+      thread_create_attr(overflow, 0, &attr);
+      thread_yield();
+      _exit(3);
+   }
+   if (pid == -1 || waitpid(pid, &status, 0) != pid)
+      error("can't fork");
+   if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      error("running off the end of a stack did not fault in its guard page");
+
+   printf("%d stack sizes used, %d default stacks recycled, guard page hit\n",
+          (int) SIZES, reused);
+   return 0;
+}
+
+void deep(void *in)
+{
+   unsigned long size = (unsigned long) in;
+   char here;
+   touch(&here, size - SLACK);
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+// writes to every page of the bytes below from, one page per call
+void touch(char *from, unsigned long bytes)
+{
+   volatile char page[4096];
+   page[0] = 1;
+   if ((unsigned long) (from - (char *) page) < bytes)
+      touch(from, bytes);
+}
+
+// the mark goes a few KB down, below the frames the exit path writes
+void recycled(void *in)
+{
+   volatile long mark[512];
+   if (mark[0] == MARK)
+      reused++;
+   mark[0] = MARK;
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+void overflow(void *in)
+{
+   char here;
+   top = &here;
+   recurse(0);
+}
+
+void recurse(int depth)
+{
+   volatile char frame[256];
+   frame[0] = depth;
+   recurse(depth + 1);
+}
+
+// exits 0 if the fault is in the page below the stack, which starts
+// overflowSize bytes below the end of the page the thread started in
+void fault(int sig, siginfo_t *info, void *context)
+{
+   long page = sysconf(_SC_PAGESIZE);
+   char *addr = info->si_addr;
+   char *end = (char *) (((long) top + page - 1) & -page) - overflowSize;
+   _exit(addr >= end - page && addr < end ? 0 : 2);
+}
+
+// yields until n threads have finished
+void waitFor(int n)
+{
+   while (__atomic_load_n(&cnt, __ATOMIC_SEQ_CST) != n)
+      thread_yield();
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
@@ -0,0 +1,98 @@
+//
+// Threads made ready by a worker that then never switches away can only
+// run if other workers steal them. The main thread creates them and waits
+// in the kernel rather than yielding, with preemption off so nothing
+// switches it out: first one thread, then enough at once to make its deque
+// grow while thieves take from it. Each has to run exactly once, on a kernel
+// thread other than main's.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// CS520 threads
+#include "thread.h"
+
+// number of workers to run threads on
+#define WORKERS 4
+
+// number of threads created at once, well past a deque's first size
+#define THREADS 1000
+
+// ms to wait for the threads to be stolen before giving up
+#define TIMEOUT 5000
+
+// times each thread ran, and the number of threads that ran
+int ran[THREADS + 1];
+int cnt;
+
+// kernel thread of the main thread, and the number of threads run on it
+long mainTid;
+int onMain;
+
+// local function prototypes
+void error(char *);
+void work(void *);
+void waitFor(int);
+
+int main(void)
+{
+   long i;
+
+   if (thread_set_workers(WORKERS) == 0)
+      error("can't set the number of workers");
+   if (thread_set_quantum(0) == 0)
+      error("can't turn preemption off");
+   mainTid = syscall(SYS_gettid);
+
+   if (thread_create(work, (void *) THREADS) == 0)
+      error("error in thread create");
+   waitFor(1);
+
+   for (i = 0; i < THREADS; i++)
+   {
+      if (thread_create(work, (void *) i) == 0)
+         error("error in thread create");
+   }
+   waitFor(THREADS + 1);
+
+   for (i = 0; i <= THREADS; i++)
+      if (ran[i] != 1)
+         error("a thread ran more than once");
+   if (onMain)
+      error("a thread ran on the blocked worker");
+
+   printf("%d threads stolen from a blocked worker\n", THREADS + 1);
+   return 0;
+}
+
+void work(void *in)
+{
+   long id = (long) in;
+
+   if (syscall(SYS_gettid) == mainTid)
+      __atomic_add_fetch(&onMain, 1, __ATOMIC_SEQ_CST);
+   __atomic_add_fetch(&ran[id], 1, __ATOMIC_SEQ_CST);
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+// sleeps in the kernel, never yielding, until n threads have run
+void waitFor(int n)
+{
+   int ms;
+
+   for (ms = 0; __atomic_load_n(&cnt, __ATOMIC_SEQ_CST) < n; ms++)
+   {
+      if (ms == TIMEOUT)
+         error("threads of a blocked worker were not stolen");
+      usleep(1000);
+   }
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
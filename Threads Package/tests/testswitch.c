@@ -0,0 +1,104 @@
+//
+// Check that a context switch keeps what the x86-64 calling convention
+// says a call keeps: the callee-saved registers, the SSE and x87 rounding
+// modes, and a 16 byte aligned stack when a thread starts.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fenv.h>
+
+// CS520 threads
+#include "thread.h"
+
+// number of threads to create
+#define THREADS 8
+
+// number of times each thread yields
+#define YIELDS 1000
+
+// counter for exiting threads
+int cnt;
+
+// number of threads that found something not kept
+int failed;
+
+int modes[4] = { FE_TONEAREST, FE_DOWNWARD, FE_UPWARD, FE_TOWARDZERO };
+
+// local function prototypes
+void work(void *);
+
+int main(void)
+{
+   long i;
+
+   for (i = 0; i < THREADS; i++)
+   {
+      if (thread_create(work, (void *) i) == 0)
+      {
+         fprintf(stderr, "error in thread create\n");
+         exit(-1);
+      }
+   }
+
+   // the main thread keeps the default rounding throughout
+   while (__atomic_load_n(&cnt, __ATOMIC_SEQ_CST) != THREADS)
+      thread_yield();
+
+   if (fegetround() != FE_TONEAREST)
+      failed++;
+
+   if (failed)
+   {
+      printf("%d of %d threads lost state across a switch\n",
+             failed, THREADS + 1);
+      return 1;
+   }
+   printf("%d threads kept their registers across %d yields each\n",
+          THREADS, YIELDS);
+   return 0;
+}
+
+void work(void *in)
+{
+   long id = (long) in;
+   int mode = modes[id % 4];
+   int ok = 1;
+   int k;
+
+   // an aligned local lands on a 16 byte boundary only if the stack did
+   double aligned[2] __attribute__((aligned(16)));
+   if (((long) aligned & 15) != 0)
+      ok = 0;
+
+   // live across every yield, so they are kept in callee-saved registers,
+   // as the test is built optimized
+   long a = id, b = 3 * id + 1, c = 5 * id + 2, d = 7 * id + 3;
+   long e = 11 * id + 4, f = 13 * id + 5;
+
+   // each thread rounds its own way; 1/3 rounds differently in each mode
+   fesetround(mode);
+   volatile double one = 1.0, three = 3.0;
+   double third = one / three;
+
+   for (k = 0; k < YIELDS; k++)
+   {
+      thread_yield();
+      if (fegetround() != mode || one / three != third)
+         ok = 0;
+      a += 1; b += 3; c += 5; d += 7; e += 11; f += 13;
+      // hides the values from the compiler, so it can't work them out from k
+      __asm__ volatile("" : "+r" (a), "+r" (b), "+r" (c), "+r" (d),
+                            "+r" (e), "+r" (f));
+   }
+
+   if (a != id + YIELDS || b != 3 * id + 1 + 3 * YIELDS ||
+       c != 5 * id + 2 + 5 * YIELDS || d != 7 * id + 3 + 7 * YIELDS ||
+       e != 11 * id + 4 + 11 * YIELDS || f != 13 * id + 5 + 13 * YIELDS)
+      ok = 0;
+
+   fesetround(FE_TONEAREST);
+   if (!ok)
+      __atomic_add_fetch(&failed, 1, __ATOMIC_SEQ_CST);
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,121 @@
+//
+// Check the preemption timer. A thread that never yields is switched out
+// for a ready one once its quantum is used up, but a thread running on its
+// own takes no timer signals at all, before another thread is created or
+// after the others have finished, and a quantum of 0 turns preemption off.
+// The library's handler is wrapped in one that counts the signals.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+// CS520 threads
+#include "thread.h"
+
+// us a thread runs before it is preempted
+#define QUANTUM 10000
+
+// timer signals taken, and the library's handler for them
+volatile sig_atomic_t ticks;
+struct sigaction library;
+
+// set by a thread once it has run
+volatile int ran;
+
+// local function prototypes
+void error(char *);
+void count(int);
+void work(void *);
+void spin(long);
+long cpuMs(void);
+
+int main(void)
+{
+   struct sigaction sa;
+   long start;
+
+   if (thread_set_workers(1) == 0 || thread_set_quantum(QUANTUM) == 0)
+      error("can't set up the threads package");
+   if (thread_set_quantum(-1) != 0)
+      error("a negative quantum was accepted");
+
+   // the package sets up its handler when first used
+   thread_self();
+   sigaction(SIGVTALRM, NULL, &library);
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = count;
+   sa.sa_flags = library.sa_flags;
+   sigaction(SIGVTALRM, &sa, NULL);
+
+   spin(100);
+   if (ticks != 0)
+      error("the timer went off with no other thread ready");
+
+   // only preemption can let the thread run while main spins
+   if (thread_create(work, 0) == 0)
+      error("error in thread create");
+   start = cpuMs();
+   while (!ran)
+      if (cpuMs() - start > 2000)
+         error("a thread that never yields was not preempted");
+   if (ticks == 0)
+      error("preempted without a timer signal");
+
+   // the next signal finds nothing ready and stops the timer
+   spin(3 * QUANTUM / 1000);
+   ticks = 0;
+   spin(100);
+   if (ticks != 0)
+      error("the timer kept going after the other threads finished");
+
+   ran = 0;
+   if (thread_set_quantum(0) == 0)
+      error("can't turn preemption off");
+   if (thread_create(work, 0) == 0)
+      error("error in thread create");
+   spin(100);
+   if (ran || ticks != 0)
+      error("preempted with a quantum of 0");
+   thread_yield();
+   if (!ran)
+      error("a yield did not run the ready thread");
+
+   printf("preempted after a quantum, no signals while running alone\n");
+   return 0;
+}
+
+void count(int sig)
+{
+   ticks++;
+   library.sa_handler(sig);
+}
+
+void work(void *in)
+{
+   ran = 1;
+}
+
+// uses up ms of cpu time without yielding
+void spin(long ms)
+{
+   long start = cpuMs();
+   while (cpuMs() - start < ms)
+      ;
+}
+
+// returns the cpu time of the calling kernel thread, in ms
+long cpuMs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
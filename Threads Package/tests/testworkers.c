@@ -0,0 +1,115 @@
+//
+// Run threads on four workers. Every thread has to run to the end, the
+// sum they add up under a mutex has to come out right however they move
+// between kernel threads, and more than one kernel thread has to have run
+// them. The worker count can only be set before the first thread.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// CS520 threads
+#include "thread.h"
+
+// number of workers to run threads on
+#define WORKERS 4
+
+// number of threads to create
+#define THREADS 64
+
+// number of additions each thread performs, yielding after each
+#define ADDS 2000
+
+// mutex to protect shared globals
+thread_mutex_t mu;
+
+// global sum and counter for exiting threads
+long sum;
+int cnt;
+
+// kernel threads seen running threads, 0 for an unused slot
+long tids[WORKERS + 1];
+
+// local function prototypes
+void error(char *);
+void work(void *);
+void seen(long);
+
+int main(void)
+{
+   long i;
+   int k, workers = 0;
+
+   if (thread_set_workers(WORKERS) == 0)
+      error("can't set the number of workers");
+   if (thread_mutex_init(&mu) == 0)
+      error("can't init mutex");
+   if (thread_set_workers(2) != 0)
+      error("set the number of workers after they were started");
+
+   for (i = 0; i < THREADS; i++)
+   {
+      if (thread_create(work, (void *) i) == 0)
+         error("error in thread create");
+   }
+
+   while (__atomic_load_n(&cnt, __ATOMIC_SEQ_CST) != THREADS)
+      thread_yield();
+
+   for (k = 0; k <= WORKERS; k++)
+      if (tids[k])
+         workers++;
+
+   if (workers > WORKERS)
+      error("threads ran on more kernel threads than there are workers");
+   if (workers < 2)
+      error("threads only ran on one worker");
+   if (sum != (long) THREADS * ADDS * (ADDS + 1) / 2)
+      error("wrong sum");
+
+   printf("%d threads added up the right sum on %d of %d workers\n",
+          THREADS, workers, WORKERS);
+   return 0;
+}
+
+void work(void *in)
+{
+   int i;
+
+   for (i = 1; i <= ADDS; i++)
+   {
+      seen(syscall(SYS_gettid));
+      if (thread_mutex_lock(&mu) == 0)
+         error("error in mutex_lock");
+      sum += i;
+      if (thread_mutex_unlock(&mu) == 0)
+         error("error in mutex_unlock");
+      thread_yield();
+   }
+
+   __atomic_add_fetch(&cnt, 1, __ATOMIC_SEQ_CST);
+}
+
+// records a kernel thread as having run a thread, in the first free slot
+void seen(long tid)
+{
+   int k;
+
+   for (k = 0; k <= WORKERS; k++)
+   {
+      long old = 0;
+      if (__atomic_load_n(&tids[k], __ATOMIC_SEQ_CST) == tid ||
+          __atomic_compare_exchange_n(&tids[k], &old, tid, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ||
+          old == tid)
+         return;
+   }
+}
+
+void error(char *str)
+{
+   fprintf(stderr, "%s\n", str);
+   exit(-1);
+}
@@ -4,36 +4,50 @@
 //
 //  Created by Jonathan Nappi on 4/6/12.
 //
+//  x86-64 context switch. Only the System V callee-saved state is kept in
+//  the TCB: rbx, rbp, r12-r15 and rsp, plus the MXCSR and x87 control word,
+//  whose control bits must also survive a call. The offsets match TCB in
+//  thread.h.
+//
 
 .text
-.align 4
+.align 16
 .globl asm_yield
 .globl asm_specialyield
+.globl asm_threadstart
 
+// asm_yield( TCB *curr, TCB *next ): curr in rdi, next in rsi
 asm_yield:
-    pushl   %ebp
-    movl    %esp, %ebp
-    jmp 	.store
-    
-asm_specialyield:
-	pushl   %ebp
-    movl    %esp, %ebp
-	jmp 	.restore
+    movq    %rbx, 0(%rdi)
+    movq    %rbp, 8(%rdi)
+    movq    %r12, 16(%rdi)
+    movq    %r13, 24(%rdi)
+    movq    %r14, 32(%rdi)
+    movq    %r15, 40(%rdi)
+    movq    %rsp, 48(%rdi)
+    stmxcsr 56(%rdi)
+    fnstcw  60(%rdi)
 
-.store:
-    movl 8(%ebp), %eax #get TBP current pointer to eax
-    movl %esi, 0(%eax)
-    movl %edi, 4(%eax)
-    movl %ebx, 8(%eax)
-    movl %esp, 12(%eax)
+// asm_specialyield( TCB *curr, TCB *next ): only restores next
+asm_specialyield:
+    movq    0(%rsi), %rbx
+    movq    8(%rsi), %rbp
+    movq    16(%rsi), %r12
+    movq    24(%rsi), %r13
+    movq    32(%rsi), %r14
+    movq    40(%rsi), %r15
+    movq    48(%rsi), %rsp
+    ldmxcsr 56(%rsi)
+    fldcw   60(%rsi)
+    ret
 
-.restore:
-    movl 12(%ebp), 	%eax #get TBP current pointer to eax
-    movl 0(%eax), 	%esi
-    movl 4(%eax), 	%edi
-    movl 8(%eax), 	%ebx
-    movl 12(%eax), 	%esp
+// first return address of a new context: the function to start is left in
+// r14 and its two arguments in r12 and r13, with the stack 16 byte aligned
+// for the call
+asm_threadstart:
+    movq    %r12, %rdi
+    movq    %r13, %rsi
+    call    *%r14
+    ud2
 
-.exit:
-    popl %ebp
-    ret
+.section .note.GNU-stack,"",@progbits
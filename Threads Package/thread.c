@@ -6,19 +6,709 @@
  *
  *  Custom threads package capable of generating new threads as well as
  *  suspending, killing, and continuing any valid thread ID that is passed in
+ *
+ *  Threads are run by one or more workers, each a kernel thread with its own
+ *  deque of ready threads. The main kernel thread is the first worker; more
+ *  can be asked for with thread_set_workers() or the THREAD_WORKERS variable,
+ *  0 meaning one per core. A worker with nothing to run steals from the
+ *  deques of others, starting at a random one, or sleeps until a thread is
+ *  made ready.
+ *
+ *  TCBs are allocated a slab at a time and reused, and thread IDs are handles
+ *  holding a TCB's index and a generation that changes each time it is
+ *  freed, so an ID is checked and turned back into its TCB in constant time
+ *  and stale IDs are never mistaken for the thread now using the TCB.
+ *
+ *  Each worker is preempted by a timer of its own, on the cpu time of its
+ *  kernel thread, every quantum microseconds (thread_set_quantum() or the
+ *  THREAD_QUANTUM variable, 0 turning preemption off). The timer only runs
+ *  while the worker has another thread ready, so a worker running one thread
+ *  on its own, or none, takes no signals.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "thread.h"
 
-TCB *head, *tail, *current, *deathQ, *suspendQ;
-long validAddresses[1000];
-int lastValidAddress = 0;
-int mainAddress, initDone = 0;
-int notBusy = 1;
+#define STACKSIZE ( 64 << 10 )   // default stack, not counting its guard page
+#define MINSTACK ( 16 << 10 )
+#define STACKCACHE 64       // free default stacks a worker keeps for itself
+#define SHAREDSTACKS 1024   // and all workers together beyond those
+#define SLABSIZE 1024       // TCBs allocated together
+#define MAXSLABS 65536
+#define TCBCACHE 256        // free TCBs a worker keeps for itself
+#define QUANTUM 10000       // default us a thread runs before being preempted
+#define SPINTRIES 10        // tries for a mutex before parking on its queue
+#define MAXBACKOFF 1024     // most pauses between two of them
+#define MAXWORKERS 256
+#define IDLEWAIT 10000000   // ns an idle worker sleeps before looking again
+#define DEQUESIZE 64        // first number of slots of a ready deque
+
+// what finishSwitch() does with the thread that was switched away from
+#define REQUEUE 1
+#define PARK 2
+#define EXIT 3
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define Worker struct Worker
+#define Ring struct Ring
+
+/**
+ * The slots of a ready deque, a power of two of them. A ring that has been
+ * outgrown is kept, linked from the one that replaced it, as a thief may
+ * still be reading from it
+ */
+Ring {
+    long mask;
+    Ring* older;
+    TCB* slots[];
+};
+
+/**
+ * A kernel thread running green threads. Its ready threads are in a
+ * Chase-Lev deque: only the worker itself pushes, at bottom, and it and
+ * thieves alike take from top with a compare-and-swap, so neither side ever
+ * takes a lock. idle is the context of its scheduling loop, which it
+ * switches to when it has no thread to run. prev, prevAction and prevLock
+ * say what is left to do for the thread it last switched away from, which
+ * can only be done once we are off its stack
+ */
+Worker {
+    TCB idle;
+    long top;
+    long bottom;
+    Ring* ring;
+    unsigned int seed;  // for picking whom to steal from
+    long* freeStacks;   // free default stacks, linked through their first word
+    int numFreeStacks;
+    TCB* freeTCBs;
+    int numFreeTCBs;
+    timer_t timer;      // preempts the thread the worker is running
+    int timerArmed;
+    TCB* prev;
+    int prevAction;
+    int* prevLock;
+    pthread_t thread;
+};
+
+static void initFrame( TCB *t, long *stack, unsigned long size,
+                       void (*start)(), void *arg1, void *arg2 );
+static void idleLoop( Worker *w );
+static void finishSwitch( void );
+
+TCB *suspendQ;
+TCB *slabs[MAXSLABS];
+int numSlabs = 0;
+TCB *sharedTCBs;
+int slabLock = 0;
+long mainAddress;
+int initDone = 0;
+Worker workers[MAXWORKERS];
+int numWorkers = -1;
+int numIdle = 0;
+int idleSeq = 0;
+long *sharedStacks;
+int numSharedStacks = 0;
+int stackLock = 0;
+unsigned long pageSize;
+long quantum = -1;
+
+// the worker a kernel thread runs, and the thread it is running. Read only
+// through thisWorker() and self(), which are never inlined: a green thread
+// can move to another kernel thread at any switch, so the compiler must not
+// keep the thread pointer it found these through
+static __thread Worker *myWorker;
+static __thread TCB *running;
+
+static __attribute__((noinline)) Worker *thisWorker( void )
+{
+    return myWorker;
+}
+
+static __attribute__((noinline)) TCB *self( void )
+{
+    if( running == NULL )
+        init( );
+    return running;
+}
+
+/**
+ * This function stops the timer switching the calling thread out until the
+ * matching preemptOn(), and returns its TCB. Sections nest, and cost no more
+ * than a counter in the thread's TCB, which moves with it from worker to
+ * worker
+ */
+static TCB *preemptOff( void )
+{
+    TCB *me = self( );
+    me->preemptCount++;
+    __atomic_signal_fence( __ATOMIC_SEQ_CST );
+    return me;
+}
+
+/**
+ * This function ends a section begun with preemptOff(). Leaving the outermost
+ * one yields if the timer went off while inside
+ */
+static void preemptOn( TCB *me )
+{
+    __atomic_signal_fence( __ATOMIC_SEQ_CST );
+    if( --me->preemptCount == 0 && me->preemptPending )
+    {
+        me->preemptPending = 0;
+        thread_yield( );
+    }
+}
+
+static void spinLock( int *lock )
+{
+    while( __atomic_exchange_n( lock, 1, __ATOMIC_ACQUIRE ) )
+        while( __atomic_load_n( lock, __ATOMIC_RELAXED ) )
+            __builtin_ia32_pause( );
+}
+
+static void spinUnlock( int *lock )
+{
+    __atomic_store_n( lock, 0, __ATOMIC_RELEASE );
+}
+
+/**
+ * This function returns how many threads are ready on a worker
+ */
+static long numReady( Worker *w )
+{
+    return __atomic_load_n( &w->bottom, __ATOMIC_SEQ_CST ) -
+           __atomic_load_n( &w->top, __ATOMIC_SEQ_CST );
+}
+
+/**
+ * This function moves the threads from top to bottom of a worker's deque to
+ * a ring twice the size, and returns the new ring
+ */
+static Ring *growRing( Worker *w, long top, long bottom )
+{
+    Ring *old = w->ring;
+    Ring *new = malloc( sizeof(Ring) + 2 * ( old->mask + 1 ) * sizeof(TCB*) );
+    long k;
+    new->mask = 2 * old->mask + 1;
+    new->older = old;
+    for( k = top; k < bottom; k++ )
+        new->slots[k & new->mask] = old->slots[k & old->mask];
+    __atomic_store_n( &w->ring, new, __ATOMIC_RELEASE );
+    return new;
+}
+
+/**
+ * This function starts or stops the preemption timer of the calling worker
+ */
+static void armTimer( Worker *w, int on )
+{
+    struct itimerspec it = { { 0, 0 }, { 0, 0 } };
+    if( on )
+    {
+        it.it_interval.tv_sec = quantum / 1000000;
+        it.it_interval.tv_nsec = quantum % 1000000 * 1000;
+        it.it_value = it.it_interval;
+    }
+    w->timerArmed = on;
+    timer_settime( w->timer, 0, &it, NULL );
+}
+
+/**
+ * This function creates the preemption timer of the calling worker, which
+ * signals only its own kernel thread
+ */
+static void createTimer( Worker *w )
+{
+    struct sigevent sev = { 0 };
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGVTALRM;
+    sev.sigev_notify_thread_id = syscall( SYS_gettid );
+    if( timer_create( CLOCK_THREAD_CPUTIME_ID, &sev, &w->timer ) != 0 )
+    {
+        fprintf( stderr, "can't create the preemption timer\n" );
+        exit( -1 );
+    }
+}
+
+/**
+ * This function puts a thread at the bottom of a worker's deque, and starts
+ * the worker's timer now that it has a thread to switch to. Only the worker
+ * itself may call it
+ */
+static void pushReady( Worker *w, TCB *t )
+{
+    long bottom = __atomic_load_n( &w->bottom, __ATOMIC_RELAXED );
+    long top = __atomic_load_n( &w->top, __ATOMIC_ACQUIRE );
+    Ring *ring = w->ring;
+    if( bottom - top > ring->mask )
+        ring = growRing( w, top, bottom );
+    __atomic_store_n( &ring->slots[bottom & ring->mask], t, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    __atomic_store_n( &w->bottom, bottom + 1, __ATOMIC_RELAXED );
+    if( !w->timerArmed && quantum > 0 )
+        armTimer( w, 1 );
+}
+
+/**
+ * This function takes the thread at the top of a worker's deque, the one
+ * ready the longest, or returns 0 if it is empty. Any worker may call it.
+ * The worker itself takes from the top too, rather than popping its newest
+ * thread from the bottom, so threads that yield still take turns
+ */
+static TCB *popReady( Worker *w )
+{
+    for( ;; )
+    {
+        long top = __atomic_load_n( &w->top, __ATOMIC_ACQUIRE );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        long bottom = __atomic_load_n( &w->bottom, __ATOMIC_ACQUIRE );
+        if( top >= bottom )
+            return 0;
+        Ring *ring = __atomic_load_n( &w->ring, __ATOMIC_ACQUIRE );
+        TCB *t = __atomic_load_n( &ring->slots[top & ring->mask],
+                                  __ATOMIC_RELAXED );
+        if( __atomic_compare_exchange_n( &w->top, &top, top + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) )
+            return t;
+    }
+}
+
+/**
+ * This function takes a thread from another worker's deque, trying each in
+ * turn from a random one, or returns 0 if every other deque is empty
+ */
+static TCB *steal( Worker *w )
+{
+    int k, start;
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 17;
+    w->seed ^= w->seed << 5;
+    start = w->seed % numWorkers;
+    for( k = 0; k < numWorkers; k++ )
+    {
+        Worker *victim = &workers[( start + k ) % numWorkers];
+        TCB *t;
+        if( victim != w && ( t = popReady( victim ) ) )
+            return t;
+    }
+    return 0;
+}
+
+/**
+ * This function returns whether any worker has a thread ready to run
+ */
+static int anyReady( void )
+{
+    int k;
+    for( k = 0; k < numWorkers; k++ )
+        if( numReady( &workers[k] ) > 0 )
+            return 1;
+    return 0;
+}
+
+/**
+ * This function returns a stack of size bytes, a whole number of pages, with
+ * an inaccessible guard page below it, so running off the end faults rather
+ * than writing over whatever is mapped there. Stacks of the default size are
+ * taken from the worker's own free list, then the shared one, and only
+ * mapped anew when both are empty. It returns 0 if no memory is left
+ */
+static long *allocStack( Worker *w, unsigned long size )
+{
+    long *stack = 0;
+    if( size == STACKSIZE )
+    {
+        if( w->freeStacks )
+        {
+            stack = w->freeStacks;
+            w->freeStacks = (long*)stack[0];
+            w->numFreeStacks--;
+            return stack;
+        }
+        spinLock( &stackLock );
+        if( sharedStacks )
+        {
+            stack = sharedStacks;
+            sharedStacks = (long*)stack[0];
+            numSharedStacks--;
+        }
+        spinUnlock( &stackLock );
+        if( stack )
+            return stack;
+    }
+    char *base = mmap( NULL, size + pageSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0 );
+    if( base == MAP_FAILED )
+        return 0;
+    mprotect( base, pageSize, PROT_NONE );
+    return (long*)( base + pageSize );
+}
+
+/**
+ * This function gives back a stack from allocStack(). Stacks of the default
+ * size go on the worker's free list, or the shared one once that is full;
+ * others, and those beyond what the shared list keeps, are unmapped
+ */
+static void freeStack( Worker *w, long *stack, unsigned long size )
+{
+    if( size == STACKSIZE && w->numFreeStacks < STACKCACHE )
+    {
+        stack[0] = (long)w->freeStacks;
+        w->freeStacks = stack;
+        w->numFreeStacks++;
+        return;
+    }
+    if( size == STACKSIZE )
+    {
+        spinLock( &stackLock );
+        if( numSharedStacks < SHAREDSTACKS )
+        {
+            stack[0] = (long)sharedStacks;
+            sharedStacks = stack;
+            numSharedStacks++;
+            stack = 0;
+        }
+        spinUnlock( &stackLock );
+        if( stack == 0 )
+            return;
+    }
+    munmap( (char*)stack - pageSize, size + pageSize );
+}
+
+/**
+ * This function allocates a new slab of TCBs onto the shared free list. The
+ * slab lock must be held. It returns 0 if there is no room or memory left
+ */
+static int newSlab( void )
+{
+    int k;
+    if( numSlabs == MAXSLABS )
+        return 0;
+    TCB *slab = calloc( SLABSIZE, sizeof(TCB) );
+    if( slab == NULL )
+        return 0;
+    for( k = SLABSIZE - 1; k >= 0; k-- )
+    {
+        slab[k].index = numSlabs * SLABSIZE + k;
+        slab[k].generation = 1;
+        slab[k].next = sharedTCBs;
+        sharedTCBs = &slab[k];
+    }
+    __atomic_store_n( &slabs[numSlabs], slab, __ATOMIC_RELEASE );
+    __atomic_store_n( &numSlabs, numSlabs + 1, __ATOMIC_RELEASE );
+    return 1;
+}
+
+/**
+ * This function returns a free TCB, from the worker's own free list if it
+ * has one, and gives it the handle of its current generation. It returns 0
+ * if no more TCBs can be allocated
+ */
+static TCB *allocTCB( Worker *w )
+{
+    TCB *t = w->freeTCBs;
+    if( t )
+    {
+        w->freeTCBs = t->next;
+        w->numFreeTCBs--;
+    }
+    else
+    {
+        spinLock( &slabLock );
+        if( sharedTCBs || newSlab( ) )
+        {
+            t = sharedTCBs;
+            sharedTCBs = t->next;
+        }
+        spinUnlock( &slabLock );
+        if( t == 0 )
+            return 0;
+    }
+    t->id = (long)( (unsigned long)t->generation << 32 | ( t->index + 1 ) );
+    return t;
+}
+
+/**
+ * This function returns the TCB of a thread ID, or 0 if the ID is not that
+ * of a live thread
+ */
+static TCB *lookup( long thread_id )
+{
+    unsigned long index = ( (unsigned long)thread_id & 0xffffffff ) - 1;
+    unsigned int generation = (unsigned long)thread_id >> 32;
+    if( index >= (unsigned long)__atomic_load_n( &numSlabs, __ATOMIC_ACQUIRE ) *
+                 SLABSIZE )
+        return 0;
+    TCB *t = &__atomic_load_n( &slabs[index / SLABSIZE],
+                               __ATOMIC_ACQUIRE )[index % SLABSIZE];
+    if( __atomic_load_n( &t->generation, __ATOMIC_ACQUIRE ) != generation )
+        return 0;
+    return t;
+}
+
+/**
+ * This function makes a thread ID, and any copies of it, invalid
+ */
+static void removeID( long thread_id )
+{
+    TCB *t = lookup( thread_id );
+    if( t )
+        __atomic_add_fetch( &t->generation, 1, __ATOMIC_RELEASE );
+}
+
+/**
+ * This function retires a TCB's ID and puts it on the worker's free list, or
+ * the shared one once the worker has enough
+ */
+static void freeTCB( Worker *w, TCB *t )
+{
+    removeID( t->id );
+    if( w->numFreeTCBs < TCBCACHE )
+    {
+        t->next = w->freeTCBs;
+        w->freeTCBs = t;
+        w->numFreeTCBs++;
+        return;
+    }
+    spinLock( &slabLock );
+    t->next = sharedTCBs;
+    sharedTCBs = t;
+    spinUnlock( &slabLock );
+}
+
+/**
+ * This function puts a thread that can run again on the calling worker's
+ * queue, and wakes a sleeping worker to come and take it if there is one
+ */
+static void makeReady( TCB *t )
+{
+    pushReady( thisWorker( ), t );
+    if( __atomic_load_n( &numIdle, __ATOMIC_SEQ_CST ) )
+    {
+        __atomic_add_fetch( &idleSeq, 1, __ATOMIC_SEQ_CST );
+        syscall( SYS_futex, &idleSeq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+    }
+}
+
+/**
+ * This function switches the calling worker from the running thread to next.
+ * What has to be done with the old thread, requeueing it, leaving it parked
+ * and releasing the lock of the queue it is parked on, or freeing it, is
+ * left to finishSwitch() on the other side, so no worker can pick the old
+ * thread up before its registers are saved
+ */
+static void switchTo( Worker *w, TCB *next, int action, int *lock )
+{
+    TCB *old = running;
+    w->prev = old;
+    w->prevAction = action;
+    w->prevLock = lock;
+    old->preemptPending = 0;
+    __atomic_store_n( &old->onCpu, 0, __ATOMIC_RELAXED );
+    __atomic_store_n( &next->onCpu, 1, __ATOMIC_RELAXED );
+    running = next;
+    asm_yield( old, next );
+    finishSwitch( );
+}
+
+/**
+ * This function finishes the switch that resumed the calling thread
+ */
+static void finishSwitch( void )
+{
+    Worker *w = thisWorker( );
+    if( w->prevAction == REQUEUE )
+        pushReady( w, w->prev );
+    else if( w->prevAction == EXIT )
+    {
+        freeStack( w, w->prev->stack, w->prev->stackSize );
+        freeTCB( w, w->prev );
+    }
+    if( w->prevLock )
+        spinUnlock( w->prevLock );
+    w->prev = 0;
+    w->prevAction = 0;
+    w->prevLock = 0;
+}
+
+/**
+ * This function returns the next thread the worker should run, its own
+ * scheduling loop if its queue is empty
+ */
+static TCB *nextToRun( Worker *w )
+{
+    TCB *next = popReady( w );
+    return next ? next : &w->idle;
+}
+
+/**
+ * This function puts a thread at the end of a wait queue
+ */
+static void enqueue( thread_queue_t *q, TCB *t )
+{
+    t->next = 0;
+    if( q->tail )
+        q->tail->next = t;
+    else
+        q->head = t;
+    q->tail = t;
+}
+
+/**
+ * This function takes the thread at the front of a wait queue, or returns 0
+ * if it is empty
+ */
+static TCB *dequeue( thread_queue_t *q )
+{
+    TCB *t = q->head;
+    if( t )
+    {
+        q->head = t->next;
+        if( q->head == 0 )
+            q->tail = 0;
+        t->next = 0;
+    }
+    return t;
+}
+
+/**
+ * This function parks the calling thread, which the caller has put on a wait
+ * queue guarded by lock. The lock is released once the thread is switched out
+ */
+static void block( int *lock )
+{
+    Worker *w = thisWorker( );
+    switchTo( w, nextToRun( w ), PARK, lock );
+}
+
+/**
+ * This function is a worker's scheduling loop. It runs its own ready threads
+ * and then those it can steal, and sleeps when there are none anywhere
+ */
+static void idleLoop( Worker *w )
+{
+    finishSwitch( );
+    for( ;; )
+    {
+        TCB *t = popReady( w );
+        if( t == 0 )
+            t = steal( w );
+        if( t )
+        {
+            switchTo( w, t, 0, 0 );
+            continue;
+        }
+        int seq = __atomic_load_n( &idleSeq, __ATOMIC_SEQ_CST );
+        __atomic_add_fetch( &numIdle, 1, __ATOMIC_SEQ_CST );
+        if( !anyReady( ) )
+        {
+            struct timespec wait = { 0, IDLEWAIT };
+            syscall( SYS_futex, &idleSeq, FUTEX_WAIT_PRIVATE, seq, &wait,
+                     NULL, 0 );
+        }
+        __atomic_sub_fetch( &numIdle, 1, __ATOMIC_SEQ_CST );
+    }
+}
+
+/**
+ * This function is where the kernel threads of workers other than the first
+ * start
+ */
+static void *workerStart( void *arg )
+{
+    Worker *w = arg;
+    myWorker = w;
+    running = &w->idle;
+    w->idle.preemptCount = 1;
+    createTimer( w );
+    idleLoop( w );
+    return 0;
+}
+
+/**
+ * This function lays out the first frame of a new context on its stack, so
+ * the first switch to it calls start( arg1, arg2 )
+ */
+static void initFrame( TCB *t, long *stack, unsigned long size,
+                       void (*start)(), void *arg1, void *arg2 )
+{
+    long *top = stack + size / sizeof(long);
+    //asm_threadstart is returned to with the stack 16 byte aligned
+    top[-3] = (long)asm_threadstart;
+    t->rsp = (long)&top[-3];
+    t->r12 = (long)arg1;
+    t->r13 = (long)arg2;
+    t->r14 = (long)start;
+    t->rbx = t->rbp = t->r15 = 0;
+    t->mxcsr = 0x1f80; //default rounding, all exceptions masked
+    t->fpucw = 0x37f;
+    t->stack = stack;
+    t->stackSize = size;
+    t->next = t->prev = 0;
+    t->preemptCount = 1; //until it has finished the switch to it
+    t->preemptPending = 0;
+}
+
+/**
+ * This function sets how many workers run threads. It has to be called
+ * before the first thread is created; 0 means one for each core
+ */
+int thread_set_workers( int n )
+{
+    if( initDone || n < 0 || n > MAXWORKERS )
+        return 0;
+    numWorkers = n;
+    return 1;
+}
+
+/**
+ * This function sets how many microseconds a thread runs before the next
+ * ready one is switched to, 0 for never. A worker whose timer is already
+ * running picks it up the next time it starts it
+ */
+int thread_set_quantum( long usec )
+{
+    if( usec < 0 )
+        return 0;
+    quantum = usec;
+    return 1;
+}
+
+/**
+ * This function initializes thread attributes to the defaults
+ */
+int thread_attr_init( thread_attr_t *attr )
+{
+    if( attr == NULL )
+        return 0;
+    attr->stackSize = STACKSIZE;
+    return 1;
+}
+
+/**
+ * This function sets the stack size of threads created with attr. It is
+ * rounded up to whole pages, and must be at least MINSTACK
+ */
+int thread_attr_setstacksize( thread_attr_t *attr, unsigned long size )
+{
+    if( attr == NULL || size < MINSTACK )
+        return 0;
+    attr->stackSize = size;
+    return 1;
+}
 
 /**
  * This function creates a thread, starts it, and puts it at the end of the
@@ -26,48 +716,57 @@ int notBusy = 1;
  */
 long thread_create( void (*func)(void*), void* info )
 {
-    notBusy = 0;
-	if( !initDone )
-		init( );
-    TCB *new = malloc( sizeof(TCB ) );
-    int* stack = malloc(16384);
-    stack[4095] = (int)info; //push info onto bottom of the stack
-    stack[4094] = (int)func;
-    stack[4092] = (int)thread_start;
-    new->esp = (int)&stack[4091];
-    new->next = 0;
-    new->prev = tail;
-    new->esi = new->edi = new->ebx = 0;
+    return thread_create_attr( func, info, NULL );
+}
+
+/**
+ * This function creates a thread with the given attributes, or the defaults
+ * if attr is NULL. It returns 0 if there is no memory for its stack
+ */
+long thread_create_attr( void (*func)(void*), void* info, thread_attr_t *attr )
+{
+    TCB *me = preemptOff( );
+    unsigned long size = attr ? attr->stackSize : STACKSIZE;
+    size = ( size + pageSize - 1 ) & ~( pageSize - 1 );
+    Worker *w = thisWorker( );
+    TCB *new = allocTCB( w );
+    long* stack = new ? allocStack( w, size ) : 0;
+    if( stack == 0 )
+    {
+        if( new )
+            freeTCB( w, new );
+        preemptOn( me );
+        return 0;
+    }
+    initFrame( new, stack, size, thread_start, func, info );
     new->isSuspended = 1;
+    long id = new->id;
 
-    tail->next = new;
-    tail = new;
-    
-    validAddresses[lastValidAddress] = (long)new;
-    lastValidAddress++;
-    notBusy = 1;
-    return (long)new;
+    makeReady( new );
+    preemptOn( me );
+    return id;
+}
+
+/**
+ * This function returns the ID of the calling thread
+ */
+long thread_self( )
+{
+    return self( )->id;
 }
 
 /**
  * This function pauses the currently executing thread, moves it to the
- * suspended queue, and then moves the next thread to be executed
+ * end of its worker's queue, and then moves the next thread to be executed
  */
 void thread_yield( )
 {
-    if( head != tail && head->next != 0)
-    {
-        notBusy = 0;
-    	TCB *oldCur = head;
-    	head = head->next;
-        head->prev = 0;
-    	tail->next = oldCur;
-        oldCur->prev = tail;
-    	tail = oldCur;
-    	oldCur->next = 0;
-        asm_yield( oldCur, head );
-        notBusy = 1;
-    }
+    TCB *me = preemptOff( );
+    Worker *w = thisWorker( );
+    TCB *next = popReady( w );
+    if( next )
+        switchTo( w, next, REQUEUE, 0 );
+    preemptOn( me );
 }
 
 /**
@@ -75,161 +774,268 @@ void thread_yield( )
  */
 void thread_start( void (*func)(void*), void* info )
 {
-    notBusy = 1;
+    finishSwitch( );
+    preemptOn( self( ) );
     func( info );
     special_yield();
 }
 
 /**
  * This function is called when a thread has finished executing it's method
- * and can now terminate.
+ * and can now terminate. Its stack is freed by the thread switched to
  */
 void special_yield(  )
 {
-    notBusy = 0;
-	if( deathQ )
-	{
-		free( deathQ->stack );
-		free( deathQ );
-	}
-	TCB *oldCur = head;
-    head = head->next;
-    head->prev = 0;
-    oldCur->next = 0;
-    deathQ = oldCur;
-    
-   	asm_specialyield( head, head );
+    preemptOff( );
+    Worker *w = thisWorker( );
+    switchTo( w, nextToRun( w ), EXIT, 0 );
 }
 
 /**
- * This function handles initializing a TCB for the main function as well as]
- * initializing all global variables
+ * This function handles initializing a TCB for the main function and the
+ * workers, as well as initializing all global variables
  */
 static void init( )
 {
-	deathQ = suspendQ = 0;
-	
-	TCB *main = malloc(sizeof(TCB));
-    head = tail = current = main;
-    main->stack = malloc(16384);
-    mainAddress = (int)&main;
+    int k;
+	suspendQ = 0;
+
+	TCB *main = allocTCB( &workers[0] );
+    main->stack = 0; //main keeps the process stack
+    mainAddress = (long)&main;
     main->next = 0;
     main->prev = 0;
     main->isSuspended = 1;
-    
-    validAddresses[0] = (long)main;
-    lastValidAddress = 1;
-    
-    struct sigaction* sa = malloc( sizeof( sigaction ) );
+    main->preemptCount = 0;
+    main->preemptPending = 0;
+    main->onCpu = 1;
+
+    pageSize = sysconf( _SC_PAGESIZE );
+    if( numWorkers < 0 )
+    {
+        const char *env = getenv( "THREAD_WORKERS" );
+        numWorkers = env ? atoi( env ) : 1;
+    }
+    if( numWorkers == 0 )
+        numWorkers = sysconf( _SC_NPROCESSORS_ONLN );
+    if( numWorkers < 1 || numWorkers > MAXWORKERS )
+        numWorkers = numWorkers < 1 ? 1 : MAXWORKERS;
+    if( quantum < 0 )
+    {
+        const char *env = getenv( "THREAD_QUANTUM" );
+        quantum = env ? atol( env ) : QUANTUM;
+    }
+
+    struct sigaction* sa = calloc( 1, sizeof( struct sigaction ) );
 	sa->sa_handler = handler;
-	
+
 	sigemptyset( &sa->sa_mask );
-	
+
 	sa->sa_flags = SA_NODEFER;
-	
+
 	sigaction( SIGVTALRM, sa, NULL );
-	
-	struct itimerval* it = malloc( sizeof( struct itimerval ) );
-	it->it_interval.tv_sec = 0;
-	it->it_interval.tv_usec = 10000;
-	it->it_value.tv_sec = 0;
-	it->it_value.tv_usec = 10000;
-	setitimer( ITIMER_VIRTUAL, it, NULL );
-    
+
+    for( k = 0; k < numWorkers; k++ )
+    {
+        workers[k].ring = malloc( sizeof(Ring) + DEQUESIZE * sizeof(TCB*) );
+        workers[k].ring->mask = DEQUESIZE - 1;
+        workers[k].ring->older = 0;
+        workers[k].seed = 2463534242u + k;
+    }
+
+    //the main kernel thread is the first worker, and needs a stack of its
+    //own for its scheduling loop
+    myWorker = &workers[0];
+    running = main;
+    createTimer( &workers[0] );
+    initFrame( &workers[0].idle, allocStack( &workers[0], STACKSIZE ),
+               STACKSIZE, idleLoop, &workers[0], 0 );
+    for( k = 1; k < numWorkers; k++ )
+        if( pthread_create( &workers[k].thread, NULL, workerStart,
+                            &workers[k] ) != 0 )
+        {
+            fprintf( stderr, "can't start worker %d\n", k );
+            exit( -1 );
+        }
+
     initDone = 1;
 }
 
 /**
- * This is a simple handler function called by the signal timer
+ * This is a simple handler function called by the worker's timer. When the
+ * worker has no other thread ready it stops the timer instead, until one is
+ * pushed. A thread with preemption off is only marked, and yields when it
+ * turns it back on; scheduling loops never do, so they are left alone
  */
 static void handler( int signal )
 {
-    if( notBusy )
+    Worker *w = thisWorker( );
+    TCB *me = self( );
+    if( numReady( w ) == 0 )
+        armTimer( w, 0 );
+    else if( me->preemptCount )
+        me->preemptPending = 1;
+    else
         thread_yield();
 }
 
+/**
+ * This function stops the calling thread being preempted, for work that
+ * must not be switched away from, such as calls into a library that is not
+ * reentrant. Calls nest, each undone by a thread_preempt_enable()
+ */
+void thread_preempt_disable( void )
+{
+    preemptOff( );
+}
+
+/**
+ * This function undoes a thread_preempt_disable(). Once no call is left
+ * undone, a preemption that came in the meantime is taken
+ */
+void thread_preempt_enable( void )
+{
+    preemptOn( self( ) );
+}
+
 /**
  * This function initializes the mutex variable passed in
  */
 int thread_mutex_init( thread_mutex_t *mutex )
 {
-    notBusy = 0;
+    TCB *me = preemptOff( );
     if( mutex != NULL )
     {
         if( mutex->init != 1 )
         {
             mutex->lock = 0;
             mutex->ownerID = -1;
-            mutex->qHead = 0;
+            mutex->waiters.head = mutex->waiters.tail = 0;
+            mutex->guard = 0;
+            mutex->locks = mutex->spun = mutex->parked = 0;
             mutex->init = 1;
-            notBusy = 1;
+            preemptOn( me );
             return 1;
         }
-        notBusy = 1;
+        preemptOn( me );
         return 0;
     }
     else
     {
-        notBusy = 1;
+        preemptOn( me );
         return 0;
     }
 }
 
 /**
- * This function locks the mutex on the current thread or if there are already
- * threads waiting on this mutex at which point the calling thread is then
- * added to this mutex's queue
+ * This function takes a mutex if it is free, with a single compare-and-swap
+ * from 0, free, to 1, held with no thread queued for it. It returns whether
+ * it got the mutex
  */
-int thread_mutex_lock( thread_mutex_t *mutex )
+static int tryMutex( thread_mutex_t *mutex )
 {
-    notBusy = 0;
-    if( mutex != NULL )
+    int free = 0;
+    return __atomic_load_n( &mutex->lock, __ATOMIC_RELAXED ) == 0 &&
+           __atomic_compare_exchange_n( &mutex->lock, &free, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+}
+
+/**
+ * This function spins for a mutex for as long as its owner is running on
+ * another worker, and so likely to release it soon, doubling the pause
+ * between tries. It gives up after SPINTRIES tries, once the owner has been
+ * switched out, or once threads are queued for the mutex, whose turn it is.
+ * It returns whether it got the mutex
+ */
+static int spinMutex( thread_mutex_t *mutex )
+{
+    int k, j, backoff = 1;
+    for( k = 0; k < SPINTRIES; k++ )
     {
-        if( mutex->ownerID == -1 ) //no one owns this mutex
-        {
-            mutex->ownerID = (long)head;
-            mutex->lock = 1;
-            notBusy = 1;
+        if( __atomic_load_n( &mutex->lock, __ATOMIC_RELAXED ) == 2 )
+            return 0;
+        TCB *owner = lookup( __atomic_load_n( &mutex->ownerID,
+                                              __ATOMIC_RELAXED ) );
+        if( owner && !__atomic_load_n( &owner->onCpu, __ATOMIC_RELAXED ) )
+            return 0;
+        for( j = 0; j < backoff; j++ )
+            __builtin_ia32_pause( );
+        if( backoff < MAXBACKOFF )
+            backoff *= 2;
+        if( tryMutex( mutex ) )
             return 1;
-        }
-        else if( mutex->ownerID == (long)head ) //you're the owner
+    }
+    return 0;
+}
+
+/**
+ * This function locks the mutex on the current thread. If it is held by a
+ * thread running on another worker the caller spins for it a little, and
+ * otherwise it is added to this mutex's queue until the mutex is handed to
+ * it
+ */
+int thread_mutex_lock( thread_mutex_t *mutex )
+{
+    TCB *me = preemptOff( );
+    if( mutex == NULL || mutex->ownerID == me->id ) //you're the owner
+    {
+        preemptOn( me );
+        return 0;
+    }
+    if( tryMutex( mutex ) )
+        mutex->locks++;
+    else if( spinMutex( mutex ) )
+    {
+        mutex->locks++;
+        mutex->spun++;
+    }
+    else
+    {
+        spinLock( &mutex->guard );
+        //2 tells the owner to look at the queue when it unlocks
+        if( __atomic_exchange_n( &mutex->lock, 2, __ATOMIC_ACQUIRE ) == 0 )
         {
-            notBusy = 1;
-            return 0;
+            __atomic_store_n( &mutex->lock, 1, __ATOMIC_RELAXED );
+            spinUnlock( &mutex->guard );
         }
-        else //mutex is currently locked
+        else
         {
-            if( mutex->qHead != 0 )
-            {
-                TCB *scan = mutex->qHead;
-                while( scan->next )
-                    scan = scan->next;
-                TCB* oldcur = head;
-                head = head->next;
-                head->prev = 0;
-                scan->next = oldcur;
-                oldcur->next = 0;
-                oldcur->prev = scan;
-                asm_yield( oldcur, head );
-            }
-            else 
-            {
-                TCB* oldcur = head;
-                head = head->next;
-                head->prev = 0;
-                oldcur->prev = oldcur->next = 0;
-                mutex->qHead = oldcur;
-                asm_yield( oldcur, head );
-            }
-            notBusy = 1;
-            return 1;
+            enqueue( &mutex->waiters, me );
+            //the unlocking thread hands us the mutex before waking us
+            block( &mutex->guard );
+            mutex->parked++;
         }
+        mutex->locks++;
     }
-    else
-    {
-        notBusy = 1;
+    mutex->ownerID = me->id;
+    preemptOn( me );
+    return 1;
+}
+
+/**
+ * This function releases a mutex held by the calling thread. With no thread
+ * queued that is a single compare-and-swap; otherwise the mutex is handed to
+ * the longest waiting thread, which is returned for the caller to make ready
+ */
+static TCB *releaseMutex( thread_mutex_t *mutex )
+{
+    int held = 1;
+    mutex->ownerID = -1;
+    if( __atomic_compare_exchange_n( &mutex->lock, &held, 0, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
         return 0;
+    spinLock( &mutex->guard );
+    TCB* getsLock = dequeue( &mutex->waiters );
+    if( getsLock != 0 )
+    {
+        mutex->ownerID = getsLock->id;
+        if( mutex->waiters.head == 0 )
+            __atomic_store_n( &mutex->lock, 1, __ATOMIC_RELAXED );
     }
+    else
+        __atomic_store_n( &mutex->lock, 0, __ATOMIC_RELEASE );
+    spinUnlock( &mutex->guard );
+    return getsLock;
 }
 
 /**
@@ -239,138 +1045,175 @@ int thread_mutex_lock( thread_mutex_t *mutex )
  */
 int thread_mutex_unlock( thread_mutex_t *mutex )
 {
-    notBusy = 0;
-    if( mutex->ownerID == (long)head )
+    TCB *me = preemptOff( );
+    if( mutex != NULL && mutex->ownerID == me->id )
     {
-        mutex->lock = 0;
-        mutex->ownerID = -1;
-        if( mutex->qHead != 0 )
-        {
-            TCB* getsLock = mutex->qHead;
-            mutex->qHead = mutex->qHead->next;
-            mutex->ownerID = (long)getsLock;
-            mutex->lock = 1;
-            tail->next = getsLock;
-            getsLock->prev = tail;
-            getsLock->next = 0;
-            tail = getsLock;
-        }
-        notBusy = 1;
+        TCB *getsLock = releaseMutex( mutex );
+        if( getsLock )
+            makeReady( getsLock );
+        preemptOn( me );
         return 1;
     }
-    notBusy = 1;
+    preemptOn( me );
     return 0;
 }
 
+/**
+ * This function copies how often a mutex was locked, and how many of those
+ * times the caller got it by spinning or had to park for it. Taking it back
+ * at the end of thread_cond_wait counts as a lock too, and as parked when the
+ * waiter had to queue for it. The counts are kept by the threads holding the
+ * mutex, so they are only exact when it is held or no longer used
+ */
+int thread_mutex_stats( thread_mutex_t *mutex, thread_mutex_stats_t *stats )
+{
+    if( mutex == NULL || stats == NULL || mutex->init != 1 )
+        return 0;
+    stats->locks = mutex->locks;
+    stats->spun = mutex->spun;
+    stats->parked = mutex->parked;
+    return 1;
+}
+
 /**
  * This function initializes the passed in cond variable
  */
 int thread_cond_init( thread_cond_t *cond )
 {
-    notBusy = 0;
+    TCB *me = preemptOff( );
     if( cond != NULL )
     {
         if( cond->init != 1 )
         {
             cond->init = 1;
-            cond->qHead = 0;
+            cond->waiters.head = cond->waiters.tail = 0;
+            cond->guard = 0;
+            preemptOn( me );
             return 1;
         }
-        notBusy = 1;
+        preemptOn( me );
         return 0;
     }
     else
     {
-        notBusy = 1;
+        preemptOn( me );
         return 0;
     }
 }
 
 /**
- * This function unlocks the passed in mutex and gives the lock to the currently
- * executing thread which also blocks on the passed in condition variable. If
- * there are already threads blocked on the cond variable, then the calling
- * thread is added to the cond's queue.
+ * This function unlocks the passed in mutex, giving it to the thread waiting
+ * on it the longest, and blocks the calling thread on the passed in condition
+ * variable behind any threads already blocked on it. It is woken already
+ * holding the mutex, as signalling moves it to the mutex's queue
  */
 int thread_cond_wait( thread_cond_t *cond, thread_mutex_t *mutex )
 {
-    notBusy = 0;
+    TCB *me = preemptOff( );
     if( cond == NULL || mutex == NULL )//cond or mutex are NULL
     {
-        notBusy = 1;
+        preemptOn( me );
         return 0;
     }
-    
-    if( mutex->ownerID != (long)head ) //calling thread not locked by mutex
+
+    if( mutex->ownerID != me->id ) //calling thread not locked by mutex
     {
-        notBusy = 1;
+        preemptOn( me );
         return 0;
     }
-    
-    if( cond->ownerID != -1 )
-    {
-        TCB* scan = cond->qHead;
-        while( scan->next )
-            scan = scan->next;
-        scan->next = head;
-        TCB* oldcur = head;
-        oldcur->prev = scan;
-        head = head->next;
-        head->prev = 0;
-        oldcur->next = 0;
-        cond->qHead = oldcur;
-        if( mutex->qHead != 0 )
-        {
-            TCB *scan = mutex->qHead;
-            while( scan->next )
-                scan = scan->next;
-            TCB* oldcur = (TCB*)mutex->ownerID;
-            scan->next = oldcur;
-            mutex->ownerID = (long)head;
-        }
-        else 
-        {
-            TCB* oldcur = (TCB*)mutex->ownerID;
-            mutex->qHead = oldcur;
-            mutex->ownerID = (long)head;
-        }
-        asm_yield( oldcur, head );
-    }
-    else
+
+    spinLock( &cond->guard );
+    me->waitMutex = mutex;
+    enqueue( &cond->waiters, me );
+
+    TCB *getsLock = releaseMutex( mutex );
+    if( getsLock )
+        makeReady( getsLock );
+    block( &cond->guard );
+    //woken holding the mutex, waitMutex still set if it parked on its queue
+    mutex->locks++;
+    if( me->waitMutex )
     {
-        cond->ownerID = (long)head;
+        mutex->parked++;
+        me->waitMutex = 0;
     }
-    
-    if( mutex->qHead != 0 )
+
+    preemptOn( me );
+    return 1;
+}
+
+/**
+ * This function moves a thread taken off a cond's queue to the queue of the
+ * mutex it waited with, so it is woken by the unlock that hands it the mutex
+ * rather than woken now only to block on the mutex again. If the mutex is
+ * free it is given the mutex at once, and returned for the caller to make
+ * ready once it has released the cond's guard; otherwise 0 is returned and
+ * the thread's waitMutex is left set, so it counts itself as parked
+ */
+static TCB *moveToMutex( TCB *t )
+{
+    thread_mutex_t *mutex = t->waitMutex;
+    spinLock( &mutex->guard );
+    if( __atomic_exchange_n( &mutex->lock, 2, __ATOMIC_ACQUIRE ) == 0 )
     {
-        TCB *scan = mutex->qHead;
-        while( scan->next )
-            scan = scan->next;
-        TCB* oldcur = (TCB*)mutex->ownerID;
-        scan->next = oldcur;
-        mutex->ownerID = (long)head;
+        __atomic_store_n( &mutex->lock, 1, __ATOMIC_RELAXED );
+        mutex->ownerID = t->id;
+        t->waitMutex = 0;
     }
-    else 
+    else
     {
-        TCB* oldcur = (TCB*)mutex->ownerID;
-        mutex->qHead = oldcur;
-        mutex->ownerID = (long)head;
+        enqueue( &mutex->waiters, t );
+        t = 0;
     }
-    notBusy = 1;
-    return 1;
+    spinUnlock( &mutex->guard );
+    return t;
 }
 
 /**
  * This function unblocks the thread that has been blocked on this cond the
- * longest
+ * longest. It goes on to wait for the mutex it blocked with, which is
+ * usually still held by the caller
  */
 int thread_cond_signal( thread_cond_t *cond )
 {
-    notBusy = 0;
+    TCB *me = preemptOff( );
     if( cond == NULL )
     {
-        notBusy = 1;
+        preemptOn( me );
         return 0;
     }
+    spinLock( &cond->guard );
+    TCB *t = dequeue( &cond->waiters );
+    TCB *ready = t ? moveToMutex( t ) : 0;
+    spinUnlock( &cond->guard );
+    if( ready )
+        makeReady( ready );
+    preemptOn( me );
     return 1;
-}
\ No newline at end of file
+}
+
+/**
+ * This function unblocks every thread blocked on this cond. They are moved
+ * to the queues of their mutexes in the order they blocked, so they get the
+ * mutex one at a time instead of all being woken to fight over it
+ */
+int thread_cond_broadcast( thread_cond_t *cond )
+{
+    TCB *me = preemptOff( );
+    if( cond == NULL )
+    {
+        preemptOn( me );
+        return 0;
+    }
+    thread_queue_t ready = { 0, 0 };
+    TCB *t;
+    spinLock( &cond->guard );
+    while( ( t = dequeue( &cond->waiters ) ) )
+        if( ( t = moveToMutex( t ) ) )
+            enqueue( &ready, t );
+    spinUnlock( &cond->guard );
+    while( ( t = dequeue( &ready ) ) )
+        makeReady( t );
+    preemptOn( me );
+    return 1;
+}
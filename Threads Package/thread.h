@@ -6,6 +6,9 @@
 #define TCB struct TCB
 #define thread_mutex_t struct thread_mutex_t
 #define thread_cond_t struct thread_cond_t
+#define thread_attr_t struct thread_attr_t
+#define thread_queue_t struct thread_queue_t
+#define thread_mutex_stats_t struct thread_mutex_stats_t
 
 long thread_create( void (*func)(void*), void* info );
 void thread_start( void (*func)(void*), void* info );
@@ -13,47 +16,98 @@ void thread_yield( void );
 void special_yield( void );
 long thread_self(void);
 static void init( void );
-static int isValidID( long thread_id );
 static void removeID( long thread_id );
 static void handler( int signal );
 void printRdyQueue( void );
+int thread_set_workers( int n );
+int thread_set_quantum( long usec );
+void thread_preempt_disable( void );
+void thread_preempt_enable( void );
 
 long thread_create(void (*)(void*), void*);
 void thread_yield(void);
 
+// the first fields are saved and restored by thr_asm.s, at fixed offsets
 TCB {
-    int esi;
-    int edi;
-    int ebx;
-    int esp;
+    long rbx;
+    long rbp;
+    long r12;
+    long r13;
+    long r14;
+    long r15;
+    long rsp;
+    int  mxcsr;
+    short fpucw;
     TCB* next;
     TCB* prev;
-    int *stack;
+    long *stack;
+    unsigned long stackSize;
     int isSuspended;
+    int preemptCount;   // nesting of sections the timer must not switch
+                        // the thread out of, such as the library's own
+    int preemptPending; // the timer went off inside one of them
+    int onCpu;      // set while a worker is running the thread
+    thread_mutex_t* waitMutex;  // the mutex to take back when the cond the
+                                // thread waits on is signalled, kept until
+                                // it wakes if it had to queue for it
+    long id;        // the thread's handle, its generation and then index + 1
+    unsigned int generation;    // bumped when the TCB is freed, so old
+                                // handles to it stop being valid
+    unsigned int index;         // place among all TCBs ever allocated
 };
 
-static void asm_yield( TCB* curr, TCB* next );
-static void asm_specialyield( TCB* curr, TCB* curr2 );
+void asm_yield( TCB* curr, TCB* next );
+void asm_specialyield( TCB* curr, TCB* curr2 );
+void asm_threadstart( void );
+
+// threads parked on a mutex or cond, oldest first, linked through next
+thread_queue_t {
+    TCB* head;
+    TCB* tail;
+};
 
 thread_mutex_t {
-    TCB* qHead;
+    thread_queue_t waiters;
     long ownerID;
-    int  lock;
+    int  lock;      // 0 free, 1 held, 2 held with threads queued for it
     int  init;
+    int  guard;     // spin lock over the queue, for threads on other workers
+    unsigned long locks;    // counted by the thread holding the mutex
+    unsigned long spun;
+    unsigned long parked;
+};
+
+// how a mutex has been contended, from thread_mutex_stats()
+thread_mutex_stats_t {
+    unsigned long locks;    // times it was locked
+    unsigned long spun;     // of those, got by spinning while its owner ran
+    unsigned long parked;   // and got by parking until it was handed over
 };
 
 int thread_mutex_init(thread_mutex_t *);
 int thread_mutex_lock(thread_mutex_t *);
 int thread_mutex_unlock(thread_mutex_t *);
+int thread_mutex_stats(thread_mutex_t *, thread_mutex_stats_t *);
 void printMutexQueue( thread_mutex_t *mutex );
 
 thread_cond_t {
-    TCB* qHead;
+    thread_queue_t waiters;
     long ownerID;
     int init;
+    int guard;
 };
 
+// attributes of a thread to be created with thread_create_attr()
+thread_attr_t {
+    unsigned long stackSize;
+};
+
+int thread_attr_init(thread_attr_t *);
+int thread_attr_setstacksize(thread_attr_t *, unsigned long);
+long thread_create_attr(void (*)(void*), void*, thread_attr_t *);
+
 int thread_cond_init(thread_cond_t *);
 int thread_cond_wait(thread_cond_t *, thread_mutex_t *);
 int thread_cond_signal(thread_cond_t *);
+int thread_cond_broadcast(thread_cond_t *);
 
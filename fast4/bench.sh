@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# Benchmark harness for fast4
+#
+# Runs fast4 over the given files once per mode, several times each, and
+# prints the best time of every phase reported by --stats, along with the
+# thread count and chunk size fast4 picked. With -p each run is also wrapped
+# in perf stat and the fewest dTLB misses are printed, which shows what
+# --hugepages saves. Builds fast4 from fast4.c next to this script
+# if it is missing or out of date.
+#
+# usage: bench.sh [-r runs] [-p] file...
+#
+
+cd "$(dirname "$0")" || exit 1
+
+RUNS=5
+PERF=
+while [ $# -gt 0 ]; do
+    case $1 in
+        -r) RUNS=$2; shift 2 ;;
+        -p) PERF=1; shift ;;
+        *) break ;;
+    esac
+done
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-r runs] [-p] file..." >&2
+    exit 1
+fi
+if [ -n "$PERF" ] && ! command -v perf >/dev/null 2>&1; then
+    echo "perf not found, ignoring -p" >&2
+    PERF=
+fi
+COUNTERS=dTLB-load-misses,dTLB-store-misses
+PERFOUT=$(mktemp)
+trap 'rm -f "$PERFOUT"' EXIT
+
+if [ ! -x fast4 ] || [ fast4.c -nt fast4 ]; then
+    ${CC:-gcc} -O2 -pthread -o fast4 fast4.c || exit 1
+fi
+
+# one line per mode: a label and the flags that select it
+MODES="threads:
+open:--table open
+art:--table art
+numa:--numa
+hugepages:--hugepages
+numa+huge:--numa --hugepages"
+
+echo "$MODES" | while IFS=: read -r label flags; do
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        if [ -n "$PERF" ]; then
+            perf stat -x, -e $COUNTERS -o "$PERFOUT" \
+                ./fast4 --stats $flags "$@" 2>&1 >/dev/null
+            awk -F, '$1 ~ /^[0-9]+$/ { printf "%s:\t%s\n", $3, $1 }' "$PERFOUT"
+        else
+            ./fast4 --stats $flags "$@" 2>&1 >/dev/null
+        fi
+        i=$((i + 1))
+    done | awk -v label="$label" -F'\t' '
+        /^[a-zA-Z-]+:\t/ {
+            t = $2 + 0
+            if (!($1 in best) || t < best[$1]) best[$1] = t
+            if (!($1 in seen)) { seen[$1] = 1; order[n++] = $1 }
+        }
+        END {
+            line = sprintf("%-10s", label)
+            for (i = 0; i < n; i++)
+                if (order[i] ~ /TLB|threads|chunk/)
+                    line = line sprintf("  %s %d", order[i], best[order[i]])
+                else
+                    line = line sprintf("  %s %.3fs", order[i], best[order[i]])
+            print line
+        }'
+done
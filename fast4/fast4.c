@@ -5,400 +5,3313 @@
 //  Created by Jon Nappi on 3/24/12.
 //
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/times.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <linux/perf_event.h>
 #include <fcntl.h>
-#include <ctype.h>
+#include <poll.h>
 #include <string.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "wordhash.h"
+#include "fast4dump.h"
 
 #define HASHSIZE 2048
 #define MAXWORDLEN 50
+#define MAXCODELEN 4
 #define MAXTOPWORDS 20
-#define MAXTHREADS 9
+#define MAXTHREADS 256
+#define KEYCLASSES 4
+#define KEYWORDS 8
+#define MAXNODES 64
+#define HUGEPAGE ( 2UL << 20 )
+#define ARENACHUNK ( 4UL << 20 )
+#define BATCHSIZE 256
+#ifndef SEGMENTSIZE
+#define SEGMENTSIZE ( 64 << 20 )
+#endif
+#define CHECKMAGIC 0x4b433446u
+#define NUMCOUNTERS 5
+#define NUMPHASES 4
+#define PHASE_TOKENIZE 0
+#define PHASE_INSERT 1
+#define PHASE_MERGE 2
+#define PHASE_AGGREGATE 3
+#define WINDOWBUCKETS 60
+#define READSIZE ( 64 << 10 )
+#define MAXCARRY 256
+#define OUTBUFSIZE ( 1 << 20 )
+#define MINCHUNK ( 64 << 10 )
+#define CHUNKSPERTHREAD 4
+#define CHUNKTIME 0.002
+#define CALIBRATESIZE ( 256 << 10 )
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_TSV 2
+#define FORMAT_BINARY 3
+#define TABLE_HASH 0
+#define TABLE_OPEN 1
+#define TABLE_ART 2
+#define ART4 0
+#define ART16 1
+#define ART48 2
+#define ART256 3
+#define MAXPREFIX 8
+_Static_assert( DUMPWORDLEN >= MAXWORDLEN, "dump records must hold any word" );
 #define HashEntry   struct HashEntry
+#define Ranked      struct Ranked
+#define TopK        struct TopK
+#define Partition   struct Partition
 #define Parameter   struct Parameter
+#define LocalEntry  struct LocalEntry
+#define Worker      struct Worker
+#define Arena       struct Arena
+#define Batch       struct Batch
+#define PerfThread  struct PerfThread
+#define ProcShared  struct ProcShared
+#define StopWord    struct StopWord
+#define TimeBucket  struct TimeBucket
+#define Follower    struct Follower
+#define DumpHeader  struct DumpHeader
+#define DumpRecord  struct DumpRecord
+#define Slot        struct Slot
+#define OpenTable   struct OpenTable
+#define ArtNode     struct ArtNode
+#define ArtNode4    struct ArtNode4
+#define ArtNode16   struct ArtNode16
+#define ArtNode48   struct ArtNode48
+#define ArtNode256  struct ArtNode256
 
+/*
+ * Words are stored inline as zero padded 64-bit lanes. Each entry belongs to
+ * one length class (8, 16, 32 or 64 bytes) and only carries that many bytes
+ * of key, so equality is a fixed number of word or vector compares. The key
+ * is followed by one bit per file the word was found in and, with --per-file,
+ * a 32-bit count of the word in each file.
+ */
 HashEntry {
-    HashEntry *prev;
-	HashEntry *next;
-	char    word[MAXWORDLEN];
-	int     wordCount;
-	int     status;
-    pthread_mutex_t myMutex;
+    HashEntry *next;
+    int     wordCount;
+    uint64_t key[];
+};
+
+/*
+ * A word of the stop list, zero padded like a key. The table of them is
+ * generated from stopwords.txt by genstop
+ */
+StopWord {
+    int     length;
+    union {
+        char    word[KEYWORDS * 8];
+        uint64_t key[KEYWORDS];
+    };
+};
+
+#include "stopwords.h"
+#include "utf8tables.h"
+
+/*
+ * A word that passed the file filter, as handed to the top-K heaps and
+ * the radix sort. Kept to 16 bytes so sorting moves as little as possible
+ */
+Ranked {
+    uint32_t  wordCount;
+    int       cls;
+    HashEntry *entry;
+};
+
+/*
+ * A min-heap of the best MAXTOPWORDS counts seen by one thread, plus every
+ * word that ties the smallest count in the heap
+ */
+TopK {
+    Ranked  heap[MAXTOPWORDS];
+    int     size;
+    Ranked  *ties;
+    int     numTies;
+    int     maxTies;
+};
+
+/*
+ * One aggregation thread's share of the tables and its results
+ */
+Partition {
+    int     id;
+    int     lo;
+    int     hi;
+    TopK    top;
+    TopK    *fileTop;
+    Ranked  *matches;
+    int     numMatches;
+    int     maxMatches;
+    uint32_t maxCount;
+    int     hist[256];
+    int     firstRun;   // first tie run starting in its share, -1 if none
+};
+
+/*
+ * One counting thread's view of a segment. The segment is dealt out in
+ * chunks of chunkSize bytes, claimed in turn through the shared nextChunk
+ */
+Parameter {
+    int     id;
+    int     acceptableStatus;
+    char    *buf;
+    int     length;
+    int     chunkSize;
+    int     *nextChunk;
+};
+
+/*
+ * A bump allocator for table entries. Entries are never freed one at a time,
+ * so they are packed into large chunks that can be backed by huge pages
+ */
+Arena {
+    char    *base;
+    size_t  used;
+    size_t  size;
+    int     fixed;
+};
+
+/*
+ * The head of a --procs worker's slice of the shared region. The worker's
+ * table and arena follow it, and the parent merges straight out of them
+ */
+ProcShared {
+    int     done;
+    LocalEntry *(*table)[HASHSIZE];
+};
+
+/*
+ * Words are tokenized into a batch and then inserted together, so the two
+ * phases can be measured separately without reading counters per token
+ */
+Batch {
+    uint64_t key[BATCHSIZE][KEYWORDS];
+    int     length[BATCHSIZE];
+    unsigned int hash[BATCHSIZE];
+    int     size;
+};
+
+/*
+ * The --perf hardware counters of one thread slot, opened as a group so one
+ * read() of the leader, the first, samples them all. Counts since the last
+ * sample are charged to whichever phase just ended
+ */
+PerfThread {
+    int     fd[NUMCOUNTERS];
+    int     slot[NUMCOUNTERS];
+    uint64_t last[NUMCOUNTERS];
+    uint64_t phase[NUMPHASES][NUMCOUNTERS];
+    long    tokens;
+};
+
+/*
+ * An entry in a --numa worker's private table. The key lanes are followed by
+ * one bit per file so presence can be merged across workers at the end
+ */
+LocalEntry {
+    LocalEntry *next;
+    int     wordCount;
+    int     lastFile;
+    uint64_t key[];
+};
+
+/*
+ * A --numa worker, pinned to one cpu. Its buffer and table are allocated and
+ * first touched by the worker itself so they land on the worker's own node
+ */
+Worker {
+    int     id;
+    int     cpu;
+    char    *buf;
+    size_t  bufSize;
+    Arena   arena;
+    LocalEntry *(*table)[HASHSIZE];
+};
+
+/*
+ * The words seen during one time slice of the --follow window, as the table
+ * entry, its length class and how many times it was seen. Each entry's place
+ * in the list is found through an open addressed index on its address
+ */
+TimeBucket {
+    Ranked  *words;
+    int     size;
+    int     max;
+    int     *slots;
+    int     numSlots;
+};
+
+/*
+ * A file being followed: how far it has been read, and the tail of the last
+ * read, which may be the start of a word still being written
+ */
+Follower {
+    int     fd;
+    int     wd;
+    off_t   offset;
+    char    carry[MAXCARRY];
+    int     carryLength;
+};
+
+/*
+ * A slot of an --table open shard: the entry and its full hash, so probes
+ * skip most other keys without touching their entries
+ */
+Slot {
+    HashEntry *entry;
+    uint32_t hash;
+};
+
+OpenTable {
+    Slot    *slots;
+    uint32_t mask;
+    uint32_t used;
+};
+
+/*
+ * The header of every --table art node. The node's key bytes start with
+ * prefixLength bytes that all keys below it share, of which only the first
+ * MAXPREFIX are kept here
+ */
+ArtNode {
+    uint8_t type;
+    uint8_t numChildren;
+    uint8_t prefixLength;
+    uint8_t prefix[MAXPREFIX];
+};
+
+ArtNode4 {
+    ArtNode n;
+    uint8_t keys[4];
+    void    *children[4];
+};
+
+ArtNode16 {
+    ArtNode n;
+    uint8_t keys[16];
+    void    *children[16];
+};
+
+/*
+ * Holds up to 48 children, with index giving one more than the slot of the
+ * child for each byte, or 0
+ */
+ArtNode48 {
+    ArtNode n;
+    uint8_t index[256];
+    void    *children[48];
+};
+
+ArtNode256 {
+    ArtNode n;
+    void    *children[256];
+};
+
+pthread_mutex_t bucketLocks[KEYCLASSES][HASHSIZE];
+pthread_barrier_t barrier;
+pthread_t threads[MAXTHREADS];
+HashEntry *hashTable[KEYCLASSES][HASHSIZE];
+OpenTable openTables[KEYCLASSES][HASHSIZE];
+void *artRoots[KEYCLASSES][HASHSIZE];
+int tableKind = TABLE_HASH;
+Partition partitions[MAXTHREADS];
+Ranked *sorted, *scratch;
+int numSorted = 0;
+int dumpAll = 0;
+int numaMode = 0;
+int hugePages = 0;
+int showStats = 0;
+int perfMode = 0;
+int numProcs = 0;
+int minFiles = -1;
+int perFile = 0;
+int insertAll = 0;
+uint64_t *inFiles, *notFiles;
+const char *checkpointPath;
+int checkpointEvery = 60;
+int resume = 0;
+int resumeFile = 0;
+off_t resumeOffset = 0;
+int resumeSkip = 0;
+pid_t checkpointPid = 0;
+int perfOpened = 0;
+int skipStopWords = 0;
+int followMode = 0;
+int outputFormat = FORMAT_TEXT;
+int numThreads = 0;
+int chunkBytes = 0;
+int windowSecs = 600;
+TimeBucket window[WINDOWBUCKETS];
+int currentBucket = 0;
+Ranked *live;
+int numLive = 0;
+int maxLive = 0;
+int numFiles = 0;
+int fileWords = 0;
+int countWords = 0;     // 64-bit words of per-file counts after the file bits
+char **fileNames;
+Worker workers[MAXTHREADS];
+Worker *procTables;
+int numProcTables = 0;
+double mergeStart;
+Arena globalArena;
+Arena threadArenas[MAXTHREADS];
+PerfThread perfThreads[MAXTHREADS];
+
+int  keyClass( int length );
+static inline int keyEquals( const uint64_t *a, const uint64_t *b, int words );
+int  buildWord( int i, const char *buf, Batch *batch );
+int  tokenize( int i, int end, const char *buf, Batch *batch );
+static int nextBoundary( const unsigned char *s, int i );
+static int skipWord( const unsigned char *s, int i );
+static int sliceStart( const unsigned char *s, int i, int start );
+void insertBatch( Arena *arena, Batch *batch, int acceptableStatus,
+                  PerfThread *pt );
+static void hashAddBatch( Arena *arena, Batch *batch, int acceptableStatus );
+static void openAddBatch( Arena *arena, Batch *batch, int acceptableStatus );
+static void artAddBatch( Arena *arena, Batch *batch, int acceptableStatus );
+int  getThreadCounts( char *fileName );
+int  getFileSizes( void* p );
+void printCounts( Ranked *list, int size, int file );
+int  compareRanked( const void *a, const void *b );
+void* count( void* p );
+void* aggregate( void* p );
+void processTable( int acceptableStatus );
+void offerTopK( TopK *top, Ranked r );
+void radixSort( Partition *part );
+void countFiles( void );
+void numaCountFiles( void );
+void* numaCount( void* p );
+void localInsertBatch( Worker *w, Batch *batch, int file, PerfThread *pt );
+int  openInput( const char *name, off_t *size );
+void countRange( Worker *w, int fd, int file, off_t lo, off_t hi, off_t size,
+                 Batch *batch, PerfThread *pt );
+int  procCountFiles( void );
+void procCount( Worker *w, const int *files, int count );
+void* procMerge( void* p );
+void followFiles( void );
+void windowInsertBatch( Batch *batch );
+uint64_t *parseFiles( const char *list );
+int  matchesFiles( const uint64_t *files );
+static HashEntry *newEntry( Arena *arena, const uint64_t *key, int words );
+int  countSegment( int fd, int acceptableStatus, off_t offset, off_t size,
+                   char *buf, int skip, int *nextSkip );
+void startCheckpoint( int file, off_t offset, int skip );
+void writeCheckpoint( const char *path, int file, off_t offset, int skip );
+void loadCheckpoint( const char *path );
+double now( void );
+void* bigAlloc( size_t size );
+void bigFree( void *p, size_t size );
+void* arenaAlloc( Arena *arena, size_t size );
+PerfThread *perfStart( int id );
+void perfSwitch( PerfThread *pt, int phase );
+void perfStop( PerfThread *pt );
+void perfReport( void );
+void tuneThreads( void );
+void runThreads( void* (*fn)( void* ), void *args, size_t size );
+
+static const struct option longOptions[] = {
+    { "all", no_argument, NULL, 'a' },
+    { "numa", no_argument, NULL, 'n' },
+    { "hugepages", no_argument, NULL, 'H' },
+    { "stats", no_argument, NULL, 's' },
+    { "perf", no_argument, NULL, 'P' },
+    { "procs", required_argument, NULL, 'p' },
+    { "min-files", required_argument, NULL, 'k' },
+    { "in", required_argument, NULL, 'i' },
+    { "not", required_argument, NULL, 'x' },
+    { "per-file", no_argument, NULL, 'f' },
+    { "checkpoint", required_argument, NULL, 'c' },
+    { "checkpoint-every", required_argument, NULL, 'e' },
+    { "resume", no_argument, NULL, 'r' },
+    { "stopwords", no_argument, NULL, 'S' },
+    { "follow", no_argument, NULL, 'F' },
+    { "window", required_argument, NULL, 'w' },
+    { "format", required_argument, NULL, 'o' },
+    { "threads", required_argument, NULL, 't' },
+    { "chunk", required_argument, NULL, 'C' },
+    { "table", required_argument, NULL, 'T' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main (int argc, char * argv[])
+{
+    int opt;
+    const char *inList = NULL, *notList = NULL;
+    while( ( opt = getopt_long( argc, argv, "anHsPp:k:i:x:fc:e:rSFw:o:t:C:T:", longOptions,
+                                NULL ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'a':
+                dumpAll = 1;
+                break;
+            case 'n':
+                numaMode = 1;
+                break;
+            case 'H':
+                hugePages = 1;
+                break;
+            case 's':
+                showStats = 1;
+                break;
+            case 'P':
+                perfMode = 1;
+                break;
+            case 'p':
+                numProcs = atoi( optarg );
+                if( numProcs > 0 )
+                    break;
+                goto usage;
+            case 'k':
+                minFiles = atoi( optarg );
+                if( minFiles > 0 )
+                    break;
+                goto usage;
+            case 'i':
+                inList = optarg;
+                break;
+            case 'x':
+                notList = optarg;
+                break;
+            case 'f':
+                perFile = 1;
+                break;
+            case 'c':
+                checkpointPath = optarg;
+                break;
+            case 'e':
+                checkpointEvery = atoi( optarg ); //0 is at every segment
+                if( checkpointEvery > 0 || strcmp( optarg, "0" ) == 0 )
+                    break;
+                goto usage;
+            case 'r':
+                resume = 1;
+                break;
+            case 'S':
+                skipStopWords = 1;
+                break;
+            case 'F':
+                followMode = 1;
+                break;
+            case 'w':
+                windowSecs = atoi( optarg );
+                if( windowSecs > 0 )
+                    break;
+                goto usage;
+            case 'o':
+                if( strcmp( optarg, "text" ) == 0 )
+                    outputFormat = FORMAT_TEXT;
+                else if( strcmp( optarg, "json" ) == 0 )
+                    outputFormat = FORMAT_JSON;
+                else if( strcmp( optarg, "tsv" ) == 0 )
+                    outputFormat = FORMAT_TSV;
+                else if( strcmp( optarg, "binary" ) == 0 )
+                    outputFormat = FORMAT_BINARY;
+                else
+                    goto usage;
+                break;
+            case 't':
+                numThreads = atoi( optarg );
+                if( numThreads > 0 && numThreads <= MAXTHREADS )
+                    break;
+                goto usage;
+            case 'C':
+                chunkBytes = atoi( optarg );
+                if( chunkBytes > 0 )
+                    break;
+                goto usage;
+            case 'T':
+                if( strcmp( optarg, "hash" ) == 0 )
+                    tableKind = TABLE_HASH;
+                else if( strcmp( optarg, "open" ) == 0 )
+                    tableKind = TABLE_OPEN;
+                else if( strcmp( optarg, "art" ) == 0 )
+                    tableKind = TABLE_ART;
+                else
+                    goto usage;
+                break;
+            default:
+            usage:
+                fprintf(stderr, "Usage: %s [--all | --per-file] [--min-files K] "
+                        "[--in LIST] [--not LIST] [--stopwords]\n"
+                        "       [--format FMT] [--threads N] [--chunk BYTES] "
+                        "[--table TABLE]\n"
+                        "       [--numa] [--procs N] [--hugepages] [--stats] "
+                        "[--perf]\n"
+                        "       [--checkpoint FILE [--checkpoint-every SECS] "
+                        "[--resume]] file...\n"
+                        "       %s --follow [--window SECS] [--all] "
+                        "[--stopwords] [--format FMT] file...\n"
+                        "LIST is comma separated file positions or ranges, "
+                        "e.g. 1,3-5\n"
+                        "FMT is text, json, tsv or binary\n"
+                        "TABLE is hash, open or art\n", argv[0], argv[0] );
+                exit( -1 );
+        }
+    }
+
+    if(optind == argc)
+    {
+        fprintf(stdout, "Error: No file given to be read\n");
+        exit( -1 );
+    }
+    if( dumpAll && perFile )
+        goto usage;
+    if( ( resume && !checkpointPath ) ||
+        ( checkpointPath && ( numaMode || numProcs ) ) )
+        goto usage;
+    if( followMode && ( perFile || minFiles > 0 || inList || notList ||
+                        numaMode || numProcs || checkpointPath ) )
+        goto usage;
+    if( tableKind != TABLE_HASH &&
+        ( numaMode || numProcs || followMode || checkpointPath ) )
+        goto usage;
+
+    static char outBuf[OUTBUFSIZE];
+    setvbuf( stdout, outBuf, _IOFBF, OUTBUFSIZE );
+    fileNames = argv + optind;
+    numFiles = argc - optind;
+    fileWords = ( numFiles + 63 ) / 64;
+    if( perFile )
+        countWords = ( numFiles + 1 ) / 2;
+    if( inList && ( inFiles = parseFiles( inList ) ) == NULL )
+        goto usage;
+    if( notList && ( notFiles = parseFiles( notList ) ) == NULL )
+        goto usage;
+    insertAll = minFiles > 0 || perFile || inFiles || notFiles;
+    if( resume )
+        loadCheckpoint( checkpointPath );
+    if( followMode )
+        followFiles( );
+
+    tuneThreads( );
+    double start = now( );
+    int acceptableStatus = numFiles;
+    if( numProcs )
+        acceptableStatus = procCountFiles( );
+    else if( numaMode )
+        numaCountFiles( );
+    else
+        countFiles( );
+    double counted = now( );
+    processTable( acceptableStatus );
+    if( showStats )
+    {
+        if( numaMode || numProcs )
+            fprintf( stderr, "count:\t%.3fs\nmerge:\t%.3fs\n",
+                     mergeStart - start, counted - mergeStart );
+        else
+            fprintf( stderr, "count:\t%.3fs\n", counted - start );
+        fprintf( stderr, "aggregate:\t%.3fs\n", now( ) - counted );
+        fprintf( stderr, "threads:\t%d\nchunk:\t%d\n", numThreads, chunkBytes );
+    }
+    if( perfMode )
+        perfReport( );
+    return 0;
+}
+
+/*
+ * This function returns the current monotonic time in seconds
+ */
+double now( )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * This function maps memory for tables, arenas and file buffers. With
+ * --hugepages it asks for 2 MB pages, and if none are reserved it falls back
+ * to normal pages marked for transparent huge pages
+ */
+void* bigAlloc( size_t size )
+{
+    void *p = MAP_FAILED;
+    if( size == 0 )
+        size = 1;
+    if( hugePages )
+    {
+        size = ( size + HUGEPAGE - 1 ) & ~( HUGEPAGE - 1 );
+#ifdef MAP_HUGETLB
+        p = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+#endif
+    }
+    if( p == MAP_FAILED )
+    {
+        p = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( p == MAP_FAILED )
+        {
+            fprintf( stderr, "can't map %lu bytes\n", (unsigned long)size );
+            exit( -1 );
+        }
+#ifdef MADV_HUGEPAGE
+        if( hugePages )
+            madvise( p, size, MADV_HUGEPAGE );
+#endif
+    }
+    return p;
+}
+
+/*
+ * This function unmaps memory from bigAlloc()
+ */
+void bigFree( void *p, size_t size )
+{
+    if( p == NULL )
+        return;
+    if( size == 0 )
+        size = 1;
+    if( hugePages )
+        size = ( size + HUGEPAGE - 1 ) & ~( HUGEPAGE - 1 );
+    munmap( p, size );
+}
+
+/*
+ * This function carves a zeroed, 16 byte aligned block out of an arena,
+ * mapping a new chunk when the current one is full
+ */
+void* arenaAlloc( Arena *arena, size_t size )
+{
+    size = ( size + 15 ) & ~(size_t)15;
+    if( arena->base == NULL || arena->used + size > arena->size )
+    {
+        if( arena->fixed )
+        {
+            fprintf( stderr, "out of shared memory\n" );
+            exit( -1 );
+        }
+        arena->size = size > ARENACHUNK ? size : ARENACHUNK;
+        arena->base = bigAlloc( arena->size );
+        arena->used = 0;
+    }
+    void *p = arena->base + arena->used;
+    arena->used += size;
+    return p;
+}
+
+static const char *counterNames[NUMCOUNTERS] = {
+    "cycles", "instructions", "LLC-misses", "dTLB-misses", "branch-misses"
 };
+static const char *phaseNames[NUMPHASES] = {
+    "tokenize", "insert", "merge", "aggregate"
+};
+
+/*
+ * This function opens one hardware counter in the calling thread's group
+ */
+static int perfOpen( int counter, int group )
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    switch( counter )
+    {
+        case 0: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case 1: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case 2: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+        case 3:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                          ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) |
+                          ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 );
+            break;
+        default: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+    }
+    return (int)syscall( SYS_perf_event_open, &attr, 0, -1, group, 0 );
+}
+
+/*
+ * This function samples a thread's counter group into values, leaving the
+ * counters that could not be opened at zero
+ */
+static void perfSample( PerfThread *pt, uint64_t *values )
+{
+    uint64_t buf[1 + NUMCOUNTERS];
+    int c;
+    memset( values, 0, NUMCOUNTERS * sizeof( uint64_t ) );
+    if( read( pt->fd[0], buf, sizeof( buf ) ) <= 0 )
+        return;
+    for( c = 0; c < NUMCOUNTERS; c++ )
+        if( pt->slot[c] >= 0 && (uint64_t)pt->slot[c] < buf[0] )
+            values[c] = buf[1 + pt->slot[c]];
+}
+
+/*
+ * This function opens the --perf counters for the calling thread and charges
+ * them to the given thread slot. It returns NULL when --perf is off or the
+ * kernel refuses the counters, which turns the other perf calls into no-ops
+ */
+PerfThread *perfStart( int id )
+{
+    static int warned = 0;
+    PerfThread *pt = &perfThreads[id];
+    int c, members = 0;
+    if( !perfMode )
+        return NULL;
+    for( c = 0; c < NUMCOUNTERS; c++ )
+    {
+        pt->fd[c] = perfOpen( c, c == 0 ? -1 : pt->fd[0] );
+        pt->slot[c] = pt->fd[c] >= 0 ? members++ : -1;
+        if( pt->fd[0] < 0 )
+        {
+            if( !warned )
+                fprintf( stderr, "can't open perf counters\n" );
+            warned = 1;
+            return NULL;
+        }
+    }
+    perfSample( pt, pt->last );
+    perfOpened = 1;
+    return pt;
+}
+
+/*
+ * This function charges the counts since the last sample to the given phase.
+ * A negative phase just drops them
+ */
+void perfSwitch( PerfThread *pt, int phase )
+{
+    uint64_t values[NUMCOUNTERS];
+    int c;
+    if( pt == NULL )
+        return;
+    perfSample( pt, values );
+    for( c = 0; c < NUMCOUNTERS; c++ )
+    {
+        if( phase >= 0 )
+            pt->phase[phase][c] += values[c] - pt->last[c];
+        pt->last[c] = values[c];
+    }
+}
+
+/*
+ * This function closes a thread's counter group, the leader last
+ */
+void perfStop( PerfThread *pt )
+{
+    int c;
+    if( pt == NULL )
+        return;
+    for( c = NUMCOUNTERS - 1; c >= 0; c-- )
+        if( pt->fd[c] >= 0 )
+        {
+            close( pt->fd[c] );
+            pt->fd[c] = -1;
+        }
+}
+
+/*
+ * This function prints one row of the --perf report
+ */
+static void perfRow( const char *who, int phase, const uint64_t *v, long tokens )
+{
+    double perToken = tokens > 0 ? 1.0 / tokens : 0;
+    fprintf( stderr, "%-6s %-10s %14llu %14llu %6.2f %10.4f %10.4f %10.4f\n",
+             who, phaseNames[phase], (unsigned long long)v[0],
+             (unsigned long long)v[1], v[0] ? (double)v[1] / v[0] : 0.0,
+             v[2] * perToken, v[3] * perToken, v[4] * perToken );
+}
+
+/*
+ * This function prints the counters of every thread slot and phase, with IPC
+ * and misses per token, followed by the totals for each phase
+ */
+void perfReport( )
+{
+    uint64_t total[NUMPHASES][NUMCOUNTERS] = { { 0 } };
+    long tokens = 0;
+    int t, ph, c;
+    char who[16];
+    if( !perfOpened )
+        return;
+    for( t = 0; t < numThreads; t++ )
+        tokens += perfThreads[t].tokens;
+    fprintf( stderr, "%-6s %-10s %14s %14s %6s %10s %10s %10s\n", "thread",
+             "phase", counterNames[0], counterNames[1], "IPC",
+             "LLC/tok", "dTLB/tok", "branch/tok" );
+    for( t = 0; t < numThreads; t++ )
+        for( ph = 0; ph < NUMPHASES; ph++ )
+        {
+            uint64_t *v = perfThreads[t].phase[ph];
+            if( v[0] == 0 && v[1] == 0 )
+                continue;
+            snprintf( who, sizeof( who ), "%d", t );
+            perfRow( who, ph, v, ph <= PHASE_INSERT ? perfThreads[t].tokens
+                                                    : tokens );
+            for( c = 0; c < NUMCOUNTERS; c++ )
+                total[ph][c] += v[c];
+        }
+    for( ph = 0; ph < NUMPHASES; ph++ )
+        if( total[ph][0] || total[ph][1] )
+            perfRow( "all", ph, total[ph], tokens );
+}
+
+/*
+ * This function returns how many cpus the cgroup's cpu quota is worth,
+ * rounded up, or 0 if there is no quota. It reads cgroup v2's cpu.max and
+ * falls back to the v1 cfs files
+ */
+static int cgroupCpus( void )
+{
+    long quota = -1, period = 0;
+    char q[32];
+    FILE *f = fopen( "/sys/fs/cgroup/cpu.max", "r" );
+    if( f )
+    {
+        if( fscanf( f, "%31s %ld", q, &period ) == 2 && strcmp( q, "max" ) != 0 )
+            quota = atol( q );
+        fclose( f );
+    }
+    else if( ( f = fopen( "/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r" ) ) )
+    {
+        if( fscanf( f, "%ld", &quota ) != 1 )
+            quota = -1;
+        fclose( f );
+        if( ( f = fopen( "/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r" ) ) )
+        {
+            if( fscanf( f, "%ld", &period ) != 1 )
+                period = 0;
+            fclose( f );
+        }
+    }
+    if( quota <= 0 || period <= 0 )
+        return 0;
+    return (int)( ( quota + period - 1 ) / period );
+}
+
+/*
+ * This function measures how many bytes a second one thread tokenizes, on
+ * up to CALIBRATESIZE bytes from the start of the first file that can be
+ * read. It returns 0 if there was nothing to measure
+ */
+static double tokenizeRate( void )
+{
+    char *buf = bigAlloc( CALIBRATESIZE + 1 );
+    Batch *batch = malloc( sizeof( Batch ) );
+    ssize_t got = 0;
+    double rate = 0;
+    int f;
+    for( f = 0; f < numFiles && got <= 0; f++ )
+    {
+        int fd = open( fileNames[f], O_RDONLY );
+        if( fd == -1 )
+            continue;
+        got = pread( fd, buf, CALIBRATESIZE, 0 );
+        close( fd );
+    }
+    if( got > 0 )
+    {
+        int i = 0;
+        buf[got] = '\0';
+        double start = now( );
+        while( i < got )
+        {
+            batch->size = 0;
+            i = tokenize( i, (int)got, buf, batch );
+        }
+        double elapsed = now( ) - start;
+        if( elapsed > 0 )
+            rate = got / elapsed;
+    }
+    free( batch );
+    bigFree( buf, CALIBRATESIZE + 1 );
+    return rate;
+}
+
+/*
+ * This function picks numThreads and chunkBytes unless they were given. A
+ * chunk is at least MINCHUNK bytes and at least CHUNKTIME seconds of
+ * tokenizing at the measured rate, so each one is worth handing to a thread.
+ * There is a thread for each cpu this process may run on, but no more than
+ * the cgroup's cpu quota allows or than there are chunks in all the files
+ * together, so small inputs are counted without starting any thread
+ */
+void tuneThreads( )
+{
+    cpu_set_t set;
+    struct stat st;
+    off_t total = 0;
+    int f, cpus = 1;
+    for( f = 0; f < numFiles; f++ )
+        if( stat( fileNames[f], &st ) == 0 )
+            total += st.st_size;
+    if( chunkBytes == 0 )
+    {
+        double rate = total > MINCHUNK ? tokenizeRate( ) : 0;
+        chunkBytes = MINCHUNK;
+        if( rate * CHUNKTIME > chunkBytes )
+            chunkBytes = (int)( rate * CHUNKTIME );
+    }
+    if( numThreads > 0 )
+        return;
+    if( sched_getaffinity( 0, sizeof( set ), &set ) == 0 )
+        cpus = CPU_COUNT( &set );
+    int quota = cgroupCpus( );
+    if( quota > 0 && quota < cpus )
+        cpus = quota;
+    if( cpus > MAXTHREADS )
+        cpus = MAXTHREADS;
+    off_t chunks = ( total + chunkBytes - 1 ) / chunkBytes;
+    numThreads = chunks < cpus ? (int)chunks : cpus;
+    if( numThreads < 1 )
+        numThreads = 1;
+}
+
+/*
+ * This function runs fn on each of numThreads arguments laid out size bytes
+ * apart, each in a thread of its own, and waits for them. With one thread it
+ * is simply called
+ */
+void runThreads( void* (*fn)( void* ), void *args, size_t size )
+{
+    int j;
+    if( numThreads == 1 )
+    {
+        fn( args );
+        return;
+    }
+    for( j = 0; j < numThreads; j++ )
+        if(pthread_create(&threads[j], NULL, fn, (char*)args + j * size) != 0)
+            fprintf( stderr, "error in thread create\n");
+    for( j = 0; j < numThreads; j++ )
+        if( pthread_join( threads[j], NULL ) != 0 )
+            fprintf( stderr, "error in thread join\n" );
+}
+
+/*
+ * This function reads each file in turn, a segment of up to SEGMENTSIZE bytes
+ * at a time, and deals each segment out in chunks to numThreads counting
+ * threads that share the global table. Segments end on a non-letter so no word is split,
+ * and between segments the table and the cursor are consistent, which is
+ * where checkpoints are taken
+ */
+void countFiles( )
+{
+    int i = resumeFile + 1;
+    off_t offset = resumeOffset;
+    int skip = resumeSkip;
+    double lastCheckpoint = now( );
+    int cls, b;
+    for( cls = 0; cls < KEYCLASSES; cls++ )
+        for( b = 0; b < HASHSIZE; b++ )
+            if( pthread_mutex_init( &bucketLocks[cls][b], NULL ) != 0 )
+                fprintf( stderr, "can't init mutex\n");
+    while( i <= numFiles )
+    {
+        const char *fileName = fileNames[i - 1];
+        int fd = open( fileName, O_RDONLY );
+        
+        if( fd == -1 )//file open fails
+        {
+            fprintf(stderr, "Can't open %s for reading!\n", fileName );
+        }
+        else//file open succeeded
+        {
+            off_t size = lseek(fd, 0, SEEK_END);
+            size_t bufSize = size < SEGMENTSIZE
+                             ? size + 1
+                             : SEGMENTSIZE + MAXWORDLEN + MAXCODELEN + 1;
+            char *buf = bigAlloc( bufSize );
+            while( offset < size )
+            {
+                int length = countSegment( fd, i, offset, size, buf, skip, &skip );
+                if( length <= 0 )
+                    break;
+                offset += length;
+                if( checkpointPath && now( ) - lastCheckpoint >= checkpointEvery )
+                {
+                    startCheckpoint( i - 1, offset, skip );
+                    lastCheckpoint = now( );
+                }
+            }
+            bigFree( buf, bufSize );
+            close(fd);
+        }    
+        offset = 0;
+        skip = 0;
+        ++i;
+    }
+    if( checkpointPid > 0 )
+        waitpid( checkpointPid, NULL, 0 );
+}
+
+/*
+ * This function counts the segment of a file starting at offset with
+ * numThreads threads. The segment is cut at the first non-letter after
+ * SEGMENTSIZE bytes. If a word too long to count runs past the cut, nextSkip
+ * tells the next segment to skip the rest of it, just as skip tells this one.
+ * It returns the length of the segment
+ */
+int countSegment( int fd, int acceptableStatus, off_t offset, off_t size,
+                  char *buf, int skip, int *nextSkip )
+{
+    int j;
+    Parameter params[MAXTHREADS];
+    off_t left = size - offset;
+    int want = SEGMENTSIZE + MAXWORDLEN + MAXCODELEN;
+    if( left < want )
+        want = (int)left;
+    int got = 0;
+    while( got < want )
+    {
+        ssize_t r = pread( fd, buf + got, want - got, offset + got );
+        if( r <= 0 )
+            break;
+        got += (int)r;
+    }
+    int cut = got;
+    *nextSkip = 0;
+    buf[got] = '\0';
+    if( offset + got < size && got > SEGMENTSIZE )
+    {
+        //a cut this close to the end may be in a code point read in part
+        cut = skipWord( (unsigned char*)buf,
+                        nextBoundary( (unsigned char*)buf, SEGMENTSIZE ) );
+        *nextSkip = cut > got - MAXCODELEN;
+    }
+    int start = 0;
+    if( skip )
+        start = skipWord( (unsigned char*)buf, 0 );
+    buf[cut] = '\0';
+
+    int buflen = cut - start;
+    int chunk = buflen / ( numThreads * CHUNKSPERTHREAD );
+    int nextChunk = 0;
+    if( chunk < chunkBytes )
+        chunk = chunkBytes;
+    for( j = 0; j < numThreads; j++ )
+    {
+        Parameter *param = &params[j];
+        param->id = j;
+        param->acceptableStatus = acceptableStatus;
+        param->buf = buf + start;
+        param->length = buflen;
+        param->chunkSize = chunk;
+        param->nextChunk = &nextChunk;
+    }
+    runThreads( count, params, sizeof( Parameter ) );
+    return cut;
+}
+
+/*
+ * This function takes a checkpoint in the background. A forked child gets a
+ * copy-on-write image of the table and writes it out while the counting goes
+ * on, so the workers only wait for the fork. If the last checkpoint is still
+ * being written this one is skipped
+ */
+void startCheckpoint( int file, off_t offset, int skip )
+{
+    if( checkpointPid > 0 )
+    {
+        if( waitpid( checkpointPid, NULL, WNOHANG ) == 0 )
+            return;
+        checkpointPid = 0;
+    }
+    fflush( stdout );
+    fflush( stderr );
+    pid_t pid = fork( );
+    if( pid == 0 )
+    {
+        writeCheckpoint( checkpointPath, file, offset, skip );
+        _exit( 0 );
+    }
+    if( pid == -1 )
+        fprintf( stderr, "error in fork\n" );
+    else
+        checkpointPid = pid;
+}
+
+/*
+ * This function writes an unsigned number as a little endian base 128 varint
+ */
+static void putVarint( FILE *out, uint64_t v )
+{
+    while( v >= 0x80 )
+    {
+        putc( (int)( v & 0x7f ) | 0x80, out );
+        v >>= 7;
+    }
+    putc( (int)v, out );
+}
+
+/*
+ * This function reads a varint written by putVarint()
+ */
+static uint64_t getVarint( FILE *in )
+{
+    uint64_t v = 0;
+    int shift = 0, c;
+    while( ( c = getc( in ) ) != EOF )
+    {
+        v |= (uint64_t)( c & 0x7f ) << shift;
+        if( !( c & 0x80 ) )
+            break;
+        shift += 7;
+    }
+    return v;
+}
+
+/*
+ * This function writes the table and the cursor to a snapshot file. The
+ * snapshot holds a header with the cursor and the size of every input file,
+ * then each word as its length, its letters, its count and its file bitmap.
+ * It is written next to path and renamed over it once it is on disk, so a
+ * crash mid-write leaves the last checkpoint intact
+ */
+void writeCheckpoint( const char *path, int file, off_t offset, int skip )
+{
+    char tmpPath[4096];
+    int cls, b, f;
+    uint64_t entries = 0;
+    snprintf( tmpPath, sizeof( tmpPath ), "%s.tmp", path );
+    FILE *out = fopen( tmpPath, "wb" );
+    if( out == NULL )
+    {
+        fprintf( stderr, "Can't open %s for writing!\n", tmpPath );
+        return;
+    }
+    putVarint( out, CHECKMAGIC );
+    putVarint( out, numFiles );
+    putVarint( out, insertAll );
+    putVarint( out, countWords );
+    for( f = 0; f < numFiles; f++ )
+    {
+        struct stat st;
+        putVarint( out, stat( fileNames[f], &st ) == 0 ? st.st_size : 0 );
+    }
+    putVarint( out, file );
+    putVarint( out, offset );
+    putVarint( out, skip );
+    for( cls = 0; cls < KEYCLASSES; cls++ )
+        for( b = 0; b < HASHSIZE; b++ )
+        {
+            HashEntry *tmp;
+            int words = 1 << cls;
+            for( tmp = hashTable[cls][b]; tmp; tmp = tmp->next )
+            {
+                int length = (int)strnlen( (const char*)tmp->key, 8 * words );
+                putc( length, out );
+                fwrite( tmp->key, 1, length, out );
+                putVarint( out, tmp->wordCount );
+                fwrite( tmp->key + words, sizeof( uint64_t ),
+                        fileWords + countWords, out );
+                entries++;
+            }
+        }
+    putc( 0, out );
+    putVarint( out, entries );
+    if( fflush( out ) != 0 || fsync( fileno( out ) ) != 0 || ferror( out ) )
+    {
+        fprintf( stderr, "error writing checkpoint %s\n", tmpPath );
+        fclose( out );
+        return;
+    }
+    fclose( out );
+    if( rename( tmpPath, path ) != 0 )
+        fprintf( stderr, "can't rename %s to %s\n", tmpPath, path );
+}
+
+/*
+ * This function loads a snapshot written by writeCheckpoint() into the empty
+ * table and sets the cursor to continue from. The snapshot must have been
+ * taken over the same files, unchanged in size, with the same filter
+ */
+void loadCheckpoint( const char *path )
+{
+    FILE *in = fopen( path, "rb" );
+    int f;
+    uint64_t entries = 0;
+    if( in == NULL )
+    {
+        fprintf( stderr, "Can't open %s for reading!\n", path );
+        exit( -1 );
+    }
+    if( getVarint( in ) != CHECKMAGIC || getVarint( in ) != (uint64_t)numFiles ||
+        getVarint( in ) != (uint64_t)insertAll ||
+        getVarint( in ) != (uint64_t)countWords )
+    {
+        fprintf( stderr, "%s is not a checkpoint of this run\n", path );
+        exit( -1 );
+    }
+    for( f = 0; f < numFiles; f++ )
+    {
+        struct stat st;
+        uint64_t size = getVarint( in );
+        if( stat( fileNames[f], &st ) != 0 || (uint64_t)st.st_size != size )
+        {
+            fprintf( stderr, "%s has changed since the checkpoint\n",
+                     fileNames[f] );
+            exit( -1 );
+        }
+    }
+    resumeFile = (int)getVarint( in );
+    resumeOffset = (off_t)getVarint( in );
+    resumeSkip = (int)getVarint( in );
+
+    int length;
+    while( ( length = getc( in ) ) > 0 && length < MAXWORDLEN )
+    {
+        uint64_t key[KEYWORDS] = { 0 };
+        int cls = keyClass( length );
+        int words = 1 << cls;
+        if( fread( key, 1, length, in ) != (size_t)length )
+            break;
+        HashEntry *new = newEntry( &globalArena, key, words );
+        new->wordCount = (int)getVarint( in );
+        if( fread( new->key + words, sizeof( uint64_t ), fileWords + countWords,
+                   in ) != (size_t)( fileWords + countWords ) )
+            break;
+        int hashIndex = hash( key, words ) & ( HASHSIZE - 1 );
+        new->next = hashTable[cls][hashIndex];
+        hashTable[cls][hashIndex] = new;
+        entries++;
+    }
+    if( length != 0 || getVarint( in ) != entries )
+    {
+        fprintf( stderr, "%s is truncated or corrupt\n", path );
+        exit( -1 );
+    }
+    fclose( in );
+}
+
+/*
+ * This function is run by each counting thread. It claims chunks of the
+ * segment until there are none left and counts the words that start in each
+ * one, which may run on past its end. The rest of a word started in the
+ * chunk before is left to that chunk
+ */
+void* count( void* p )
+{
+    Parameter *params = (Parameter*)p;
+    const unsigned char *s = (const unsigned char*)params->buf;
+    Arena *arena = &threadArenas[params->id];
+    Batch batch;
+    batch.size = 0;
+    PerfThread *pt = perfStart( params->id );
+    for( ;; )
+    {
+        int lo = __atomic_fetch_add( params->nextChunk, 1, __ATOMIC_RELAXED );
+        if( lo >= ( params->length + params->chunkSize - 1 ) / params->chunkSize )
+            break;
+        lo *= params->chunkSize;
+        int hi = params->length - lo > params->chunkSize ? lo + params->chunkSize
+                                                         : params->length;
+        int i = lo > 0 ? sliceStart( s, lo, 0 ) : 0;
+        while( i < hi )
+        {
+            i = tokenize( i, hi, params->buf, &batch );
+            if( batch.size == BATCHSIZE )
+                insertBatch( arena, &batch, params->acceptableStatus, pt );
+        }
+    }
+    insertBatch( arena, &batch, params->acceptableStatus, pt );
+    perfStop( pt );
+    return 0;
+}
+
+/*
+ * This function checks a word against the stop list with the word's own hash:
+ * one slot to probe and at most one key to compare
+ */
+static inline int isStopWord( const uint64_t *key, int length, int words,
+                              unsigned int h )
+{
+    int k = stopSlots[( h * STOPMUL ) >> ( 32 - STOPBITS )];
+    return k != 0 && stopWords[k - 1].length == length &&
+           keyEquals( key, stopWords[k - 1].key, words );
+}
+
+/*
+ * This function decodes the UTF-8 sequence at s into *c and returns its
+ * length, or 0 if it is not well formed. Overlong forms, surrogates and
+ * sequences cut short by the terminating zero byte are all rejected
+ */
+static inline int decodeUtf8( const unsigned char *s, unsigned int *c )
+{
+    if( s[0] < 0x80 )
+    {
+        *c = s[0];
+        return 1;
+    }
+    if( s[0] < 0xc2 || ( s[1] & 0xc0 ) != 0x80 )
+        return 0;
+    if( s[0] < 0xe0 )
+    {
+        *c = ( s[0] & 0x1f ) << 6 | ( s[1] & 0x3f );
+        return 2;
+    }
+    if( ( s[2] & 0xc0 ) != 0x80 )
+        return 0;
+    if( s[0] < 0xf0 )
+    {
+        *c = ( s[0] & 0x0f ) << 12 | ( s[1] & 0x3f ) << 6 | ( s[2] & 0x3f );
+        return *c >= 0x800 && ( *c < 0xd800 || *c > 0xdfff ) ? 3 : 0;
+    }
+    if( s[0] > 0xf4 || ( s[3] & 0xc0 ) != 0x80 )
+        return 0;
+    *c = ( s[0] & 0x07 ) << 18 | ( s[1] & 0x3f ) << 12 |
+         ( s[2] & 0x3f ) << 6 | ( s[3] & 0x3f );
+    return *c >= 0x10000 && *c <= 0x10ffff ? 4 : 0;
+}
+
+/*
+ * This function writes a code point as UTF-8 and returns its length
+ */
+static inline int encodeUtf8( unsigned int c, unsigned char *s )
+{
+    if( c < 0x80 )
+    {
+        s[0] = c;
+        return 1;
+    }
+    if( c < 0x800 )
+    {
+        s[0] = 0xc0 | c >> 6;
+        s[1] = 0x80 | ( c & 0x3f );
+        return 2;
+    }
+    if( c < 0x10000 )
+    {
+        s[0] = 0xe0 | c >> 12;
+        s[1] = 0x80 | ( ( c >> 6 ) & 0x3f );
+        s[2] = 0x80 | ( c & 0x3f );
+        return 3;
+    }
+    s[0] = 0xf0 | c >> 18;
+    s[1] = 0x80 | ( ( c >> 12 ) & 0x3f );
+    s[2] = 0x80 | ( ( c >> 6 ) & 0x3f );
+    s[3] = 0x80 | ( c & 0x3f );
+    return 4;
+}
+
+static inline int isAsciiLetter( unsigned int c )
+{
+    return ( ( c | 0x20 ) - 'a' ) < 26;
+}
+
+/*
+ * This function looks a code point up in the letter bitmap of utf8tables.h
+ */
+static inline int isLetter( unsigned int c )
+{
+    return letterBits[letterIndex[c >> LETTERSHIFT]][( c >> 3 ) & 31] >>
+           ( c & 7 ) & 1;
+}
+
+/*
+ * This function returns the simple case folding of a letter
+ */
+static inline unsigned int foldLetter( unsigned int c )
+{
+    return c + foldDelta[foldIndex[c >> FOLDSHIFT]][c & ( ( 1 << FOLDSHIFT ) - 1 )];
+}
+
+/*
+ * This function tells whether a letter starts at s. Either way *length is
+ * set to how far to move on: the letter, or one byte of anything else
+ */
+static inline int letterAt( const unsigned char *s, int *length )
+{
+    unsigned int c;
+    if( s[0] < 0x80 )
+    {
+        *length = 1;
+        return isAsciiLetter( s[0] );
+    }
+    *length = decodeUtf8( s, &c );
+    if( *length == 0 )
+    {
+        *length = 1;
+        return 0;
+    }
+    return isLetter( c );
+}
+
+/*
+ * This function moves i off any continuation bytes to the start of the next
+ * code point
+ */
+static int nextBoundary( const unsigned char *s, int i )
+{
+    int k;
+    for( k = 1; k < MAXCODELEN && ( s[i] & 0xc0 ) == 0x80; k++ )
+        ++i;
+    return i;
+}
+
+/*
+ * This function skips the letters starting at i
+ */
+static int skipWord( const unsigned char *s, int i )
+{
+    int n;
+    while( letterAt( s + i, &n ) )
+        i += n;
+    return i;
+}
+
+/*
+ * This function returns where the words of a slice beginning at byte i
+ * start: the next code point, past the rest of a word if the code point
+ * before it is a letter. Nothing before start is looked at
+ */
+static int sliceStart( const unsigned char *s, int i, int start )
+{
+    int k, n;
+    i = nextBoundary( s, i );
+    k = i - 1;
+    while( k > start && i - k < MAXCODELEN && ( s[k] & 0xc0 ) == 0x80 )
+        --k;
+    if( k >= start && letterAt( s + k, &n ) && k + n == i )
+        i = skipWord( s, i );
+    return i;
+}
+
+/*
+ * This function begins building a word off of the information passed from
+ * it's calling function of the last byte read and the buffer being read. The
+ * word is case folded straight into a zero padded UTF-8 key at the end of the
+ * batch, and kept there along with its hash if it has at least six letters,
+ * fits in MAXWORDLEN - 1 bytes and, with --stopwords, it is not a stop word.
+ * ASCII letters are folded in line; only other bytes go through the tables.
+ * The buffer must end in a non-letter
+ */
+int buildWord( int i, const char *buf, Batch *batch )
+{
+    const unsigned char *s = (const unsigned char*)buf;
+    uint64_t *key = batch->key[batch->size];
+    unsigned char *word = (unsigned char*)key;
+    int j = 0, letters = 0;
+    memset( key, 0, KEYWORDS * sizeof( uint64_t ) );
+    while( 1 )
+    {
+        unsigned int c = s[i];
+        int n = 1;
+        if( c < 0x80 )
+        {
+            if( !isAsciiLetter( c ) )
+                break;
+            c |= 0x20;
+        }
+        else
+        {
+            n = decodeUtf8( s + i, &c );
+            if( n == 0 || !isLetter( c ) )
+                break;
+            c = foldLetter( c );
+        }
+        if( j < MAXWORDLEN )
+            j += encodeUtf8( c, word + j );
+        ++letters;
+        i += n;
+    }
+    if( letters > 5 && j < MAXWORDLEN )
+    {
+        int words = keyWords( j );
+        unsigned int h = hash( key, words );
+        if( skipStopWords && isStopWord( key, j, words, h ) )
+            return i;
+        batch->hash[batch->size] = h;
+        batch->length[batch->size++] = j;
+    }
+    return i;
+}
+
+/*
+ * This function classifies the 64 bytes at s at once. It returns 0 if any of
+ * them is not ASCII, and otherwise 1 with a bit in *letters for each letter
+ */
+static inline int asciiBlock( const unsigned char *s, uint64_t *letters )
+{
+#ifdef __SSE2__
+    const __m128i lower = _mm_set1_epi8( 0x20 );
+    const __m128i bias = _mm_set1_epi8( (char)( 0x80 - 'a' ) );
+    const __m128i limit = _mm_set1_epi8( (char)( 0x80 + 26 ) );
+    uint64_t high = 0, mask = 0;
+    int k;
+    for( k = 0; k < 4; k++ )
+    {
+        __m128i v = _mm_loadu_si128( (const __m128i*)( s + 16 * k ) );
+        //'a' to 'z' land on the 26 smallest signed bytes
+        __m128i x = _mm_add_epi8( _mm_or_si128( v, lower ), bias );
+        high |= (uint64_t)(unsigned)_mm_movemask_epi8( v ) << ( 16 * k );
+        mask |= (uint64_t)(unsigned)_mm_movemask_epi8(
+                    _mm_cmplt_epi8( x, limit ) ) << ( 16 * k );
+    }
+    *letters = mask;
+    return high == 0;
+#else
+    //without SSE2 every byte is classified by letterAt() instead
+    (void)s;
+    *letters = 0;
+    return 0;
+#endif
+}
+
+/*
+ * This function builds the words that start from byte i up to end into the
+ * batch until it is full, and returns where it stopped. Wherever the next 64
+ * bytes are all ASCII, the words in them are found from a bitmap of their
+ * letters and the bytes between words are never looked at one by one
+ */
+int tokenize( int i, int end, const char *buf, Batch *batch )
+{
+    const unsigned char *s = (const unsigned char*)buf;
+    int n;
+    while( i < end && batch->size < BATCHSIZE )
+    {
+        uint64_t letters;
+        if( i + 64 <= end && asciiBlock( s + i, &letters ) )
+        {
+            int base = i;
+            while( letters && batch->size < BATCHSIZE )
+            {
+                i = buildWord( base + __builtin_ctzll( letters ), buf, batch );
+                letters = i - base < 64 ? letters & ( ~0ULL << ( i - base ) )
+                                        : 0;
+            }
+            if( !letters && i < base + 64 )
+                i = base + 64;
+        }
+        else if( letterAt( s + i, &n ) )
+            i = buildWord( i, buf, batch );
+        else
+            i += n;
+    }
+    return i;
+}
+
+/*
+ * This function adds every word of a batch to the table and empties it. With
+ * --perf the counts up to here are charged to tokenizing and the inserts
+ * themselves to inserting
+ */
+void insertBatch( Arena *arena, Batch *batch, int acceptableStatus,
+                  PerfThread *pt )
+{
+    perfSwitch( pt, PHASE_TOKENIZE );
+    if( tableKind == TABLE_HASH )
+        hashAddBatch( arena, batch, acceptableStatus );
+    else if( tableKind == TABLE_OPEN )
+        openAddBatch( arena, batch, acceptableStatus );
+    else
+        artAddBatch( arena, batch, acceptableStatus );
+    perfSwitch( pt, PHASE_INSERT );
+    if( pt )
+        pt->tokens += batch->size;
+    batch->size = 0;
+}
+
+/*
+ * This function returns the length class of a word: 0 for keys of up to 8
+ * bytes, 1 for 16, 2 for 32 and 3 for 64
+ */
+int keyClass( int length )
+{
+    if( length <= 8 )
+        return 0;
+    if( length <= 16 )
+        return 1;
+    if( length <= 32 )
+        return 2;
+    return 3;
+}
+
+/*
+ * This function compares two keys of the given number of 64-bit lanes. Callers
+ * pass a constant so each length class compiles down to one or two compares
+ */
+static inline int keyEquals( const uint64_t *a, const uint64_t *b, int words )
+{
+#ifdef __SSE2__
+    if( words >= 2 )
+    {
+        int i;
+        __m128i diff = _mm_setzero_si128( );
+        for( i = 0; i < words; i += 2 )
+            diff = _mm_or_si128( diff, _mm_xor_si128(
+                        _mm_loadu_si128( (const __m128i*)( a + i ) ),
+                        _mm_loadu_si128( (const __m128i*)( b + i ) ) ) );
+        return _mm_movemask_epi8( _mm_cmpeq_epi8( diff,
+                        _mm_setzero_si128( ) ) ) == 0xffff;
+    }
+#endif
+    uint64_t diff = 0;
+    int i;
+    for( i = 0; i < words; i++ )
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/*
+ * This function returns the per-file counts of an entry's key of the given
+ * number of lanes, kept only with --per-file
+ */
+static inline uint32_t *fileCounts( uint64_t *key, int words )
+{
+    return (uint32_t*)( key + words + fileWords );
+}
+
+/*
+ * This function allocates a new table entry holding a key of the given length
+ * class from the given arena, with no files marked yet
+ */
+static HashEntry *newEntry( Arena *arena, const uint64_t *key, int words )
+{
+    HashEntry *new = arenaAlloc( arena, sizeof(HashEntry) + ( words + fileWords +
+                                 countWords ) * sizeof(uint64_t) );
+    memcpy( new->key, key, words * sizeof(uint64_t) );
+    memset( new->key + words, 0, ( fileWords + countWords ) * sizeof(uint64_t) );
+    new->next = 0;
+    new->wordCount = 0;
+    return new;
+}
+
+/*
+ * This function makes a new entry for a key and puts it on the shard's list
+ * in hashTable, which is what everything after counting walks, whatever
+ * backend found the key
+ */
+static inline HashEntry *listEntry( Arena *arena, const uint64_t *key,
+                                    int words, int cls, int shard )
+{
+    HashEntry *new = newEntry( arena, key, words );
+    new->next = hashTable[cls][shard];
+    hashTable[cls][shard] = new;
+    return new;
+}
+
+/*
+ * This function is the chained hash table backend: the shard's list is the
+ * hash chain itself
+ */
+static inline __attribute__((always_inline))
+HashEntry *hashFind( Arena *arena, const uint64_t *key, int cls, int shard,
+                     int words, int insert )
+{
+    HashEntry *tmp = hashTable[cls][shard];
+    while( tmp && !keyEquals( tmp->key, key, words ) )
+        tmp = tmp->next;
+    if( tmp == NULL && insert ) //word not found at hashIndex
+        tmp = listEntry( arena, key, words, cls, shard );
+    return tmp;
+}
+
+/*
+ * This function doubles an open addressing table, or makes its first slots
+ */
+static void openGrow( OpenTable *t )
+{
+    uint32_t size = t->slots ? 2 * ( t->mask + 1 ) : 16, k;
+    Slot *slots = calloc( size, sizeof( Slot ) );
+    for( k = 0; t->slots && k <= t->mask; k++ )
+        if( t->slots[k].entry )
+        {
+            uint32_t i = ( t->slots[k].hash / HASHSIZE ) & ( size - 1 );
+            while( slots[i].entry )
+                i = ( i + 1 ) & ( size - 1 );
+            slots[i] = t->slots[k];
+        }
+    free( t->slots );
+    t->slots = slots;
+    t->mask = size - 1;
+}
+
+/*
+ * This function is the open addressing backend. Each shard has its own table
+ * of entry pointers and hashes, probed linearly from the hash bits above the
+ * shard's, so keys are only compared when their whole hash matches. Tables
+ * grow when three quarters full
+ */
+static inline __attribute__((always_inline))
+HashEntry *openFind( Arena *arena, const uint64_t *key, unsigned int h,
+                     int cls, int shard, int words, int insert )
+{
+    OpenTable *t = &openTables[cls][shard];
+    uint32_t i;
+    if( t->slots )
+        for( i = ( h / HASHSIZE ) & t->mask; t->slots[i].entry;
+             i = ( i + 1 ) & t->mask )
+            if( t->slots[i].hash == h &&
+                keyEquals( t->slots[i].entry->key, key, words ) )
+                return t->slots[i].entry;
+    if( !insert )
+        return NULL;
+    if( t->slots == NULL || 4 * ( t->used + 1 ) > 3 * ( t->mask + 1 ) )
+        openGrow( t );
+    for( i = ( h / HASHSIZE ) & t->mask; t->slots[i].entry;
+         i = ( i + 1 ) & t->mask )
+        ;
+    t->slots[i].entry = listEntry( arena, key, words, cls, shard );
+    t->slots[i].hash = h;
+    t->used++;
+    return t->slots[i].entry;
+}
+
+#define ARTLEAF( entry ) ( (void*)( (uintptr_t)( entry ) | 1 ) )
+#define ISARTLEAF( node ) ( (uintptr_t)( node ) & 1 )
+#define ARTENTRY( node ) ( (HashEntry*)( (uintptr_t)( node ) - 1 ) )
+
+static ArtNode *artNewNode( Arena *arena, int type )
+{
+    static const size_t sizes[] = { sizeof( ArtNode4 ), sizeof( ArtNode16 ),
+                                    sizeof( ArtNode48 ), sizeof( ArtNode256 ) };
+    ArtNode *n = arenaAlloc( arena, sizes[type] );
+    n->type = type;
+    return n;
+}
+
+/*
+ * This function returns the slot holding a node's child for byte c, or NULL
+ */
+static inline void **artChild( ArtNode *n, uint8_t c )
+{
+    int i;
+    switch( n->type )
+    {
+        case ART4:
+        {
+            ArtNode4 *a = (ArtNode4*)n;
+            for( i = 0; i < n->numChildren; i++ )
+                if( a->keys[i] == c )
+                    return &a->children[i];
+            return NULL;
+        }
+        case ART16:
+        {
+            ArtNode16 *a = (ArtNode16*)n;
+#ifdef __SSE2__
+            int hits = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_set1_epi8( (char)c ),
+                           _mm_loadu_si128( (const __m128i*)a->keys ) ) ) &
+                       ( ( 1 << n->numChildren ) - 1 );
+            return hits ? &a->children[__builtin_ctz( hits )] : NULL;
+#else
+            for( i = 0; i < n->numChildren; i++ )
+                if( a->keys[i] == c )
+                    return &a->children[i];
+            return NULL;
+#endif
+        }
+        case ART48:
+        {
+            ArtNode48 *a = (ArtNode48*)n;
+            return a->index[c] ? &a->children[a->index[c] - 1] : NULL;
+        }
+        default:
+        {
+            ArtNode256 *a = (ArtNode256*)n;
+            return a->children[c] ? &a->children[c] : NULL;
+        }
+    }
+}
+
+/*
+ * This function adds a child for byte c to a node, first moving the node to
+ * the next bigger kind if it is full, in which case *ref is pointed at the
+ * new node. Children are kept in the order they were added
+ */
+static void artAddChild( Arena *arena, void **ref, ArtNode *n, uint8_t c,
+                         void *child )
+{
+    int i;
+    ArtNode *bigger;
+    switch( n->type )
+    {
+        case ART4:
+        {
+            ArtNode4 *a = (ArtNode4*)n;
+            if( n->numChildren < 4 )
+            {
+                a->keys[n->numChildren] = c;
+                a->children[n->numChildren++] = child;
+                return;
+            }
+            ArtNode16 *b = (ArtNode16*)( bigger = artNewNode( arena, ART16 ) );
+            memcpy( b->keys, a->keys, sizeof( a->keys ) );
+            memcpy( b->children, a->children, sizeof( a->children ) );
+            break;
+        }
+        case ART16:
+        {
+            ArtNode16 *a = (ArtNode16*)n;
+            if( n->numChildren < 16 )
+            {
+                a->keys[n->numChildren] = c;
+                a->children[n->numChildren++] = child;
+                return;
+            }
+            ArtNode48 *b = (ArtNode48*)( bigger = artNewNode( arena, ART48 ) );
+            for( i = 0; i < 16; i++ )
+                b->index[a->keys[i]] = i + 1;
+            memcpy( b->children, a->children, sizeof( a->children ) );
+            break;
+        }
+        case ART48:
+        {
+            ArtNode48 *a = (ArtNode48*)n;
+            if( n->numChildren < 48 )
+            {
+                a->children[n->numChildren++] = child;
+                a->index[c] = n->numChildren;
+                return;
+            }
+            ArtNode256 *b = (ArtNode256*)( bigger = artNewNode( arena, ART256 ) );
+            for( i = 0; i < 256; i++ )
+                if( a->index[i] )
+                    b->children[i] = a->children[a->index[i] - 1];
+            break;
+        }
+        default:
+            ( (ArtNode256*)n )->children[c] = child;
+            n->numChildren++;
+            return;
+    }
+    bigger->numChildren = n->numChildren;
+    bigger->prefixLength = n->prefixLength;
+    memcpy( bigger->prefix, n->prefix, sizeof( n->prefix ) );
+    *ref = bigger;
+    artAddChild( arena, ref, bigger, c, child );
+}
+
+/*
+ * This function returns any entry below a node. Its key holds the node's
+ * whole prefix, of which the node only keeps the first MAXPREFIX bytes
+ */
+static HashEntry *artAnyEntry( void *node )
+{
+    while( !ISARTLEAF( node ) )
+    {
+        ArtNode *n = node;
+        if( n->type == ART4 )
+            node = ( (ArtNode4*)n )->children[0];
+        else if( n->type == ART16 )
+            node = ( (ArtNode16*)n )->children[0];
+        else if( n->type == ART48 )
+            node = ( (ArtNode48*)n )->children[0];
+        else
+        {
+            ArtNode256 *a = (ArtNode256*)n;
+            int c = 0;
+            while( a->children[c] == NULL )
+                ++c;
+            node = a->children[c];
+        }
+    }
+    return ARTENTRY( node );
+}
+
+/*
+ * This function returns how many bytes of a node's prefix the key matches
+ * from depth on
+ */
+static int artPrefixMatch( ArtNode *n, const uint8_t *k, int depth )
+{
+    int max = n->prefixLength < MAXPREFIX ? n->prefixLength : MAXPREFIX, i;
+    for( i = 0; i < max; i++ )
+        if( n->prefix[i] != k[depth + i] )
+            return i;
+    if( n->prefixLength > MAXPREFIX )
+    {
+        const uint8_t *full = (const uint8_t*)artAnyEntry( n )->key;
+        for( ; i < n->prefixLength; i++ )
+            if( full[depth + i] != k[depth + i] )
+                return i;
+    }
+    return i;
+}
+
+/*
+ * This function is the trie backend, an adaptive radix tree per shard over
+ * the bytes of the zero padded key, under the shard's mutex like the other
+ * backends. Shards are picked by the hash of the whole key, as a prefix would
+ * pile common starts onto a few locks. Nodes hold 4, 16, 48 or 256 children
+ * and grow from one kind to the next; runs of bytes with a single child are
+ * folded into the node below as its prefix, so words with a common beginning
+ * in a shard store it once. Leaves are entries, tagged in the low bit, and a
+ * leaf can sit above the full depth of its key, since every key in a class
+ * has the same length and is compared whole on the way out
+ */
+static inline __attribute__((always_inline))
+HashEntry *artFind( Arena *arena, const uint64_t *key, int cls, int shard,
+                    int words, int insert )
+{
+    const uint8_t *k = (const uint8_t*)key;
+    void **ref = &artRoots[cls][shard];
+    int depth = 0;
+    for( ;; )
+    {
+        void *node = *ref;
+        HashEntry *new;
+        if( node == NULL )
+        {
+            if( !insert )
+                return NULL;
+            new = listEntry( arena, key, words, cls, shard );
+            *ref = ARTLEAF( new );
+            return new;
+        }
+        if( ISARTLEAF( node ) )
+        {
+            HashEntry *old = ARTENTRY( node );
+            const uint8_t *o = (const uint8_t*)old->key;
+            int p = depth;
+            if( keyEquals( old->key, key, words ) )
+                return old;
+            if( !insert )
+                return NULL;
+            while( o[p] == k[p] )
+                ++p;
+            ArtNode *n = artNewNode( arena, ART4 );
+            n->prefixLength = p - depth;
+            memcpy( n->prefix, k + depth,
+                    p - depth < MAXPREFIX ? p - depth : MAXPREFIX );
+            new = listEntry( arena, key, words, cls, shard );
+            artAddChild( arena, ref, n, o[p], node );
+            artAddChild( arena, ref, n, k[p], ARTLEAF( new ) );
+            *ref = n;
+            return new;
+        }
+        ArtNode *n = node;
+        if( n->prefixLength )
+        {
+            int p = artPrefixMatch( n, k, depth );
+            if( p < n->prefixLength )//split the prefix where the key leaves it
+            {
+                if( !insert )
+                    return NULL;
+                ArtNode *m = artNewNode( arena, ART4 );
+                uint8_t c;
+                m->prefixLength = p;
+                memcpy( m->prefix, n->prefix, p < MAXPREFIX ? p : MAXPREFIX );
+                if( n->prefixLength <= MAXPREFIX )
+                {
+                    c = n->prefix[p];
+                    n->prefixLength -= p + 1;
+                    memmove( n->prefix, n->prefix + p + 1, n->prefixLength );
+                }
+                else
+                {
+                    const uint8_t *full = (const uint8_t*)artAnyEntry( n )->key;
+                    c = full[depth + p];
+                    n->prefixLength -= p + 1;
+                    memcpy( n->prefix, full + depth + p + 1,
+                            n->prefixLength < MAXPREFIX ? n->prefixLength
+                                                        : MAXPREFIX );
+                }
+                new = listEntry( arena, key, words, cls, shard );
+                artAddChild( arena, ref, m, c, n );
+                artAddChild( arena, ref, m, k[depth + p], ARTLEAF( new ) );
+                *ref = m;
+                return new;
+            }
+            depth += n->prefixLength;
+        }
+        void **child = artChild( n, k[depth] );
+        if( child == NULL )
+        {
+            if( !insert )
+                return NULL;
+            new = listEntry( arena, key, words, cls, shard );
+            artAddChild( arena, ref, n, k[depth], ARTLEAF( new ) );
+            return new;
+        }
+        ref = child;
+        ++depth;
+    }
+}
+
+/*
+ * This function adds the passed in key into the table of its length class, or,
+ * if the word is already in the table, incriments that words count, and marks
+ * the word as found in file number acceptableStatus. When only words found in
+ * every file are wanted, new words are only inserted from the first file. It
+ * is always inlined into one copy per backend and length class, with both
+ * fixed, and holds the lock of the key's shard around the backend's lookup
+ */
+static inline __attribute__((always_inline))
+void addKey( Arena *arena, const uint64_t *key, unsigned int h, int cls,
+             int words, int acceptableStatus, int kind )
+{
+    int file = acceptableStatus - 1;
+    int insert = file == 0 || insertAll;
+    int shard = h & ( HASHSIZE - 1 );
+    HashEntry *tmp;
+    pthread_mutex_lock(&bucketLocks[cls][shard]);
+    if( kind == TABLE_HASH )
+        tmp = hashFind( arena, key, cls, shard, words, insert );
+    else if( kind == TABLE_OPEN )
+        tmp = openFind( arena, key, h, cls, shard, words, insert );
+    else
+        tmp = artFind( arena, key, cls, shard, words, insert );
+    if( tmp )
+    {
+        tmp->wordCount = tmp->wordCount + 1;
+        tmp->key[words + file / 64] |= 1ULL << ( file % 64 );
+        if( countWords )
+            fileCounts( tmp->key, words )[file]++;
+    }
+    pthread_mutex_unlock(&bucketLocks[cls][shard]);
+}
+
+#define DEFINE_ADD( name, kind, bytes, cls )                                 \
+static void name##bytes( Arena *arena, const uint64_t *key, unsigned int h,  \
+                         int acceptableStatus )                              \
+{                                                                            \
+    addKey( arena, key, h, cls, bytes / 8, acceptableStatus, kind );         \
+}
+
+/*
+ * This instantiates a backend: an add for each length class and an insert
+ * of a whole batch that dispatches every word to the add for its class
+ */
+#define DEFINE_TABLE( name, kind )                                           \
+DEFINE_ADD( name, kind, 8, 0 )                                               \
+DEFINE_ADD( name, kind, 16, 1 )                                              \
+DEFINE_ADD( name, kind, 32, 2 )                                              \
+DEFINE_ADD( name, kind, 64, 3 )                                              \
+static void name##Batch( Arena *arena, Batch *batch, int acceptableStatus )  \
+{                                                                            \
+    int k;                                                                   \
+    for( k = 0; k < batch->size; k++ )                                       \
+    {                                                                        \
+        const uint64_t *key = batch->key[k];                                 \
+        unsigned int h = batch->hash[k];                                     \
+        switch( keyClass( batch->length[k] ) )                               \
+        {                                                                    \
+            case 0:  name##8( arena, key, h, acceptableStatus );  break;     \
+            case 1:  name##16( arena, key, h, acceptableStatus ); break;     \
+            case 2:  name##32( arena, key, h, acceptableStatus ); break;     \
+            default: name##64( arena, key, h, acceptableStatus ); break;     \
+        }                                                                    \
+    }                                                                        \
+}
+
+DEFINE_TABLE( hashAdd, TABLE_HASH )
+DEFINE_TABLE( openAdd, TABLE_OPEN )
+DEFINE_TABLE( artAdd, TABLE_ART )
+
+/*
+ * This function lists the cpus this process may run on, taking one cpu from
+ * each NUMA node in turn so consecutive workers are spread across nodes. It
+ * returns the number of cpus listed
+ */
+int numaCpus( int *cpus, int max )
+{
+    cpu_set_t allowed;
+    static int nodeCpu[MAXNODES][CPU_SETSIZE];
+    int nodeSize[MAXNODES] = { 0 };
+    int used[MAXNODES] = { 0 };
+    int node, cpu, n = 0, seen = 0;
+
+    CPU_ZERO( &allowed );
+    if( sched_getaffinity( 0, sizeof( allowed ), &allowed ) != 0 )
+        return 0;
+    for( node = 0; node < MAXNODES; node++ )
+    {
+        char path[64], list[4096], *p;
+        snprintf( path, sizeof( path ),
+                  "/sys/devices/system/node/node%d/cpulist", node );
+        int fd = open( path, O_RDONLY );
+        if( fd == -1 )
+            continue;
+        int len = (int)read( fd, list, sizeof( list ) - 1 );
+        close( fd );
+        list[len > 0 ? len : 0] = '\0';
+        p = list;
+        while( *p >= '0' && *p <= '9' )
+        {
+            int lo = (int)strtol( p, &p, 10 ), hi = lo;
+            if( *p == '-' )
+                hi = (int)strtol( p + 1, &p, 10 );
+            for( cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++ )
+                if( CPU_ISSET( cpu, &allowed ) )
+                {
+                    nodeCpu[node][nodeSize[node]++] = cpu;
+                    CPU_CLR( cpu, &allowed );
+                    seen++;
+                }
+            if( *p == ',' )
+                ++p;
+        }
+    }
+    for( cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++ )//cpus with no node
+        if( CPU_ISSET( cpu, &allowed ) )
+            cpus[n++] = cpu;
+    while( n < max && seen > 0 )
+    {
+        for( node = 0; node < MAXNODES && n < max; node++ )
+            if( used[node] < nodeSize[node] )
+            {
+                cpus[n++] = nodeCpu[node][used[node]++];
+                seen--;
+            }
+    }
+    return n;
+}
+
+/*
+ * This function runs the --numa counting workers, numThreads of them, pinned
+ * round robin over the nodes' cpus, and waits for them to count and merge
+ */
+void numaCountFiles( )
+{
+    int cpus[CPU_SETSIZE];
+    int numCpus = numaCpus( cpus, CPU_SETSIZE );
+    int j;
+    if( pthread_barrier_init( &barrier, NULL, numThreads ) != 0 )
+        fprintf( stderr, "can't init barrier\n");
+    for( j = 0; j < numThreads; j++ )
+    {
+        Worker *w = &workers[j];
+        w->id = j;
+        w->cpu = numCpus > 0 ? cpus[j % numCpus] : -1;
+    }
+    runThreads( numaCount, workers, sizeof( Worker ) );
+    pthread_barrier_destroy( &barrier );
+}
+
+/*
+ * This function counts a word into a --numa worker's private table, marking
+ * the word as present in the given file. Like addKey() it is inlined once per
+ * length class
+ */
+static inline __attribute__((always_inline))
+void localAddKey( Worker *w, const uint64_t *key, unsigned int h, int cls,
+                  int words, int file )
+{
+    LocalEntry **bucket = &w->table[cls][h & ( HASHSIZE - 1 )];
+    LocalEntry *tmp = *bucket;
+    while( tmp && !keyEquals( tmp->key, key, words ) )
+        tmp = tmp->next;
+    if( tmp == NULL )
+    {
+        tmp = arenaAlloc( &w->arena, sizeof( LocalEntry ) + ( words + fileWords +
+                                     countWords ) * sizeof( uint64_t ) );
+        memcpy( tmp->key, key, words * sizeof( uint64_t ) );
+        tmp->lastFile = -1;
+        tmp->next = *bucket;
+        *bucket = tmp;
+    }
+    tmp->wordCount++;
+    if( tmp->lastFile != file )
+    {
+        tmp->lastFile = file;
+        tmp->key[words + file / 64] |= 1ULL << ( file % 64 );
+    }
+    if( countWords )
+        fileCounts( tmp->key, words )[file]++;
+}
+
+/*
+ * This function adds every word of a batch to a --numa worker's table and
+ * empties it, charging the counters like insertBatch()
+ */
+void localInsertBatch( Worker *w, Batch *batch, int file, PerfThread *pt )
+{
+    int k;
+    perfSwitch( pt, PHASE_TOKENIZE );
+    for( k = 0; k < batch->size; k++ )
+    {
+        const uint64_t *key = batch->key[k];
+        unsigned int h = batch->hash[k];
+        switch( keyClass( batch->length[k] ) )
+        {
+            case 0:  localAddKey( w, key, h, 0, 1, file ); break;
+            case 1:  localAddKey( w, key, h, 1, 2, file ); break;
+            case 2:  localAddKey( w, key, h, 2, 4, file ); break;
+            default: localAddKey( w, key, h, 3, 8, file ); break;
+        }
+    }
+    perfSwitch( pt, PHASE_INSERT );
+    if( pt )
+        pt->tokens += batch->size;
+    batch->size = 0;
+}
+
+/*
+ * This function merges the given bucket of every table in from into the
+ * global table, ORing the file bits together and adding up per-file counts
+ */
+static void mergeBucket( Arena *arena, Worker *from, int numFrom, int cls,
+                         int bucket )
+{
+    int words = 1 << cls;
+    int j, k;
+    for( j = 0; j < numFrom; j++ )
+    {
+        LocalEntry *e;
+        for( e = from[j].table[cls][bucket]; e; e = e->next )
+        {
+            HashEntry *tmp = hashTable[cls][bucket];
+            while( tmp && !keyEquals( tmp->key, e->key, words ) )
+                tmp = tmp->next;
+            if( tmp == NULL )
+            {
+                tmp = newEntry( arena, e->key, words );
+                tmp->next = hashTable[cls][bucket];
+                hashTable[cls][bucket] = tmp;
+            }
+            tmp->wordCount += e->wordCount;
+            for( k = 0; k < fileWords; k++ )
+                tmp->key[words + k] |= e->key[words + k];
+            for( k = 0; k < 2 * countWords; k++ )
+                fileCounts( tmp->key, words )[k] += fileCounts( e->key, words )[k];
+        }
+    }
+}
+
+/*
+ * This function opens an input file and returns its size through size, or -1
+ * if it can't be read as a regular file. Directories and the like are turned
+ * away here, as lseek() gives them sizes no buffer can be mapped for
+ */
+int openInput( const char *name, off_t *size )
+{
+    struct stat st;
+    int fd = open( name, O_RDONLY );
+    if( fd == -1 )
+        return -1;
+    if( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) )
+    {
+        close( fd );
+        return -1;
+    }
+    *size = st.st_size;
+    return fd;
+}
+
+/*
+ * This function counts the words starting in bytes lo up to hi of a file into
+ * a worker's own table, SEGMENTSIZE bytes at a time through the worker's
+ * buffer. Each window is read far enough past its end to finish a word begun
+ * in it, and the next window starts where that word ended, skipping the rest
+ * of it if it was too long to count. A word running into lo is left to
+ * whoever counts the bytes before it
+ */
+void countRange( Worker *w, int fd, int file, off_t lo, off_t hi, off_t size,
+                 Batch *batch, PerfThread *pt )
+{
+    off_t pos = lo;
+    while( pos < hi )
+    {
+        off_t start = pos > MAXCODELEN ? pos - MAXCODELEN : 0;
+        off_t stop = hi - pos > SEGMENTSIZE ? pos + SEGMENTSIZE : hi;
+        off_t end = stop + MAXWORDLEN + MAXCODELEN < size
+                    ? stop + MAXWORDLEN + MAXCODELEN : size;
+        int want = (int)( end - start );
+        if( (size_t)want + 1 > w->bufSize )
+        {
+            bigFree( w->buf, w->bufSize );
+            w->bufSize = want + 1;
+            w->buf = bigAlloc( w->bufSize );
+        }
+        char *buf = w->buf;
+        int n = 0;
+        while( n < want )
+        {
+            ssize_t r = pread( fd, buf + n, want - n, start + n );
+            if( r <= 0 )
+                break;
+            n += (int)r;
+        }
+        buf[n] = '\0';
+
+        int i = (int)( pos - start );
+        int last = (int)( stop - start );
+        if( last > n )
+            last = n;
+        if( pos > 0 )//skip a word started before this window
+            i = sliceStart( (unsigned char*)buf, i, 0 );
+        while( i < last )
+        {
+            i = tokenize( i, last, buf, batch );
+            if( batch->size == BATCHSIZE )
+                localInsertBatch( w, batch, file, pt );
+        }
+        localInsertBatch( w, batch, file, pt );
+        if( n < want )//the file got shorter
+            break;
+        pos = start + i;
+    }
+}
 
-Parameter {
-    int chunkSize;
-    int acceptableStatus;
-    int id;
-    char *buf;
-};
+/*
+ * This function is run by each --numa worker. After pinning itself it reads
+ * its own slice of every file into its own buffer and counts the slice into
+ * its own table, so nothing it touches while counting lives on another node.
+ * Once every worker is done the workers merge the tables, each taking a range
+ * of buckets
+ */
+void* numaCount( void* p )
+{
+    Worker *w = (Worker*)p;
+    int f;
+    if( w->cpu >= 0 )
+    {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( w->cpu, &set );
+        pthread_setaffinity_np( pthread_self( ), sizeof( set ), &set );
+    }
+    w->table = bigAlloc( KEYCLASSES * sizeof( *w->table ) );
+    Batch batch;
+    batch.size = 0;
+    PerfThread *pt = perfStart( w->id );
 
-pthread_mutex_t mutex;
-pthread_cond_t	cond;
-pthread_t threads[MAXTHREADS];
-int deadThreads = 0;
-HashEntry *hashTable[HASHSIZE];
-HashEntry *head, *tail;
+    for( f = 0; f < numFiles; f++ )
+    {
+        off_t size;
+        int fd = openInput( fileNames[f], &size );
+        if( fd == -1 )
+        {
+            if( w->id == 0 )
+                fprintf(stderr, "Can't open %s for reading!\n", fileNames[f] );
+            continue;
+        }
+        countRange( w, fd, f, size * w->id / numThreads,
+                    size * ( w->id + 1 ) / numThreads, size, &batch, pt );
+        close( fd );
+    }
 
-int  hash( char *word );
-void add( char *word, int acceptableStatus );
-int  buildWord( int i, char *buf, int acceptableStatus );
-int  getThreadCounts( char *fileName );
-int  getFileSizes( void* p );
-void printCounts( void );
-void* count( void* p );
-void processTable( int acceptableStatus );
-void insertWCount( HashEntry *tmp );
+    pthread_barrier_wait( &barrier );
+    if( w->id == 0 )
+        mergeStart = now( );
+    perfSwitch( pt, -1 );
+    int buckets = KEYCLASSES * HASHSIZE;
+    int b = (int)( (long)buckets * w->id / numThreads );
+    int bEnd = (int)( (long)buckets * ( w->id + 1 ) / numThreads );
+    for( ; b < bEnd; b++ )
+        mergeBucket( &w->arena, workers, numThreads, b / HASHSIZE,
+                     b % HASHSIZE );
+    perfSwitch( pt, PHASE_MERGE );
+    perfStop( pt );
+    return 0;
+}
 
-int main (int argc, const char * argv[])
+/*
+ * This function runs --procs mode. Files are dealt out to numProcs forked
+ * worker processes, biggest first to whoever has the fewest bytes so far, and
+ * each worker counts its files into its own slice of one shared memfd region.
+ * The region is mapped before forking, so the tables keep the same addresses
+ * and the parent merges them in place. A worker that crashes only loses its
+ * own files, and the words are then matched against the files that survived.
+ * It returns how many files that is
+ */
+int procCountFiles( )
 {
-    head = tail = 0;
-    if(argc == 1)
+    off_t *sizes = calloc( numFiles, sizeof( off_t ) );
+    off_t *load = calloc( numProcs, sizeof( off_t ) );
+    int *owner = malloc( numFiles * sizeof( int ) );
+    int *order = malloc( numFiles * sizeof( int ) );
+    pid_t *pids = calloc( numProcs, sizeof( pid_t ) );
+    int f, g, j, survivors = 0;
+
+    for( f = 0; f < numFiles; f++ )
     {
-        fprintf(stdout, "Error: No file given to be read\n");
-        exit( -1 );
+        struct stat st;
+        sizes[f] = stat( fileNames[f], &st ) == 0 ? st.st_size : 0;
+        order[f] = f;
+    }
+    for( f = 1; f < numFiles; f++ )//biggest files first
+        for( g = f; g > 0 && sizes[order[g]] > sizes[order[g - 1]]; g-- )
+        {
+            int t = order[g];
+            order[g] = order[g - 1];
+            order[g - 1] = t;
+        }
+    for( f = 0; f < numFiles; f++ )
+    {
+        int best = 0;
+        for( j = 1; j < numProcs; j++ )
+            if( load[j] < load[best] )
+                best = j;
+        owner[order[f]] = best;
+        load[best] += sizes[order[f]];
     }
 
-	if(pthread_mutex_init(&mutex, NULL) != 0)
-      	fprintf( stderr, "can't init mutex\n");
-
-   	if(pthread_cond_init(&cond, NULL) != 0)
-      	fprintf( stderr, "can't init condition variable\n");
+    /* at most one entry per 7 bytes of input: 6 letters and a separator */
+    size_t entryMax = ( sizeof( LocalEntry ) +
+                        ( KEYWORDS + fileWords + countWords ) * sizeof( uint64_t ) +
+                        15 ) & ~15UL;
+    size_t head = ( sizeof( ProcShared ) + 63 ) & ~63UL;
+    size_t tables = KEYCLASSES * sizeof( *workers[0].table );
+    size_t *offset = calloc( numProcs + 1, sizeof( size_t ) );
+    for( j = 0; j < numProcs; j++ )
+    {
+        size_t bytes = head + tables + ( load[j] / 7 + 1 ) * entryMax;
+        offset[j + 1] = offset[j] + ( ( bytes + HUGEPAGE - 1 ) & ~( HUGEPAGE - 1 ) );
+    }
+    int fd = memfd_create( "fast4", 0 );
+    if( fd == -1 || ftruncate( fd, offset[numProcs] ) != 0 )
+    {
+        fprintf( stderr, "can't create shared region\n" );
+        exit( -1 );
+    }
+    char *region = mmap( NULL, offset[numProcs], PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0 );
+    close( fd );
+    if( region == MAP_FAILED )
+    {
+        fprintf( stderr, "can't map shared region\n" );
+        exit( -1 );
+    }
 
-    int i = 1;
-    while( i < argc )
+    procTables = calloc( numProcs, sizeof( Worker ) );
+    fflush( stdout );
+    fflush( stderr );
+    for( j = 0; j < numProcs; j++ )
     {
-        int fd = open( argv[i], O_RDONLY );
-        
-        if( fd == -1 )//file open fails
+        Worker *w = &procTables[j];
+        ProcShared *shared = (ProcShared*)( region + offset[j] );
+        w->id = j;
+        w->table = (void*)( region + offset[j] + head );
+        w->arena.base = region + offset[j] + head + tables;
+        w->arena.size = offset[j + 1] - offset[j] - head - tables;
+        w->arena.fixed = 1;
+        shared->table = w->table;
+        pids[j] = fork( );
+        if( pids[j] == 0 )
         {
-            fprintf(stderr, "Can't open %s for reading!\n", argv[i] );
+            int mine[numFiles], count = 0;
+            for( f = 0; f < numFiles; f++ )
+                if( owner[f] == j )
+                    mine[count++] = f;
+            procCount( w, mine, count );
+            shared->done = 1;
+            _exit( 0 );
         }
-        else//file open succeeded
+        if( pids[j] == -1 )
+            fprintf( stderr, "error in fork\n" );
+    }
+
+    for( j = 0; j < numProcs; j++ )
+    {
+        int status = 0;
+        ProcShared *shared = (ProcShared*)( region + offset[j] );
+        if( pids[j] > 0 )
+            waitpid( pids[j], &status, 0 );
+        if( pids[j] > 0 && WIFEXITED( status ) && WEXITSTATUS( status ) == 0 &&
+            shared->done )
         {
-            int j = 0;
-            deadThreads = 0;
-            int buflen = (int)lseek(fd, 0, SEEK_END);
-            lseek(fd, 0, SEEK_SET);
-            char buf[buflen];
-            read( fd, buf, buflen );
-            while( j < MAXTHREADS )
-            {
-                Parameter *param = malloc( sizeof( Parameter ) );
-                param->acceptableStatus = i;
-                if( buflen >= MAXTHREADS )
-                    param->chunkSize = ( buflen/MAXTHREADS);
-                else
-                    param->chunkSize = buflen;
-                param->id = j;
-                param->buf = buf;
-                if(pthread_create(&threads[j], NULL, count, (void*) param) != 0)
-                    fprintf( stderr, "error in thread create\n");
-                ++j;
-            }
-        }    
-        close(fd);
-        if( deadThreads != MAXTHREADS )
+            procTables[numProcTables++] = procTables[j];
+            for( f = 0; f < numFiles; f++ )
+                if( owner[f] == j )
+                    survivors++;
+            continue;
+        }
+        fprintf( stderr, "worker %d failed, skipping:", j );
+        for( f = 0; f < numFiles; f++ )
+            if( owner[f] == j )
+                fprintf( stderr, " %s", fileNames[f] );
+        fprintf( stderr, "\n" );
+    }
+
+    mergeStart = now( );
+    for( j = 0; j < numThreads; j++ )
+        workers[j].id = j;
+    runThreads( procMerge, workers, sizeof( Worker ) );
+
+    free( sizes );
+    free( load );
+    free( owner );
+    free( order );
+    free( pids );
+    free( offset );
+    return survivors;
+}
+
+/*
+ * This function is run in a --procs worker process. It counts each of its
+ * files into the worker's shared table, a segment at a time
+ */
+void procCount( Worker *w, const int *files, int count )
+{
+    Batch *batch = malloc( sizeof( Batch ) );
+    int k;
+    batch->size = 0;
+    for( k = 0; k < count; k++ )
+    {
+        off_t size;
+        int fd = openInput( fileNames[files[k]], &size );
+        if( fd == -1 )
         {
-            if( pthread_cond_wait( &cond, &mutex ) != 0)
-                fprintf( stderr, "error in cond_wait by master\n" );
+            fprintf(stderr, "Can't open %s for reading!\n", fileNames[files[k]] );
+            continue;
         }
-        ++i;
+        countRange( w, fd, files[k], 0, size, size, batch, NULL );
+        close( fd );
     }
-    
-    processTable( argc - 1 );
-    printCounts( );
+    bigFree( w->buf, w->bufSize );
+    free( batch );
+}
+
+/*
+ * This function is run by each of the parent's merge threads in --procs mode.
+ * It merges its range of buckets out of the surviving workers' tables
+ */
+void* procMerge( void* p )
+{
+    Worker *w = (Worker*)p;
+    int buckets = KEYCLASSES * HASHSIZE;
+    int b = (int)( (long)buckets * w->id / numThreads );
+    int bEnd = (int)( (long)buckets * ( w->id + 1 ) / numThreads );
+    for( ; b < bEnd; b++ )
+        mergeBucket( &w->arena, procTables, numProcTables, b / HASHSIZE,
+                     b % HASHSIZE );
     return 0;
 }
 
 /*
- * This function opens and reads the file by processing all of the words as
- * they come in. It then closes the file.
+ * This function adds one sighting of a table entry to a time bucket, growing
+ * its index when it gets half full
  */
-void* count( void* p )
+static void bucketAdd( TimeBucket *b, HashEntry *entry, int cls )
 {
-    Parameter *params = (Parameter*)p;
-    int minRange;
-    if( params->id == 0 )
-        minRange = 0;
-    else
-        minRange = params->chunkSize * params->id - 1; 
-    int maxRange = minRange + params->chunkSize - 1;
-    
-    int i = minRange;
-    if( params->id != 0 )
+    int k;
+    if( 2 * ( b->size + 1 ) > b->numSlots )
     {
-        if( isalpha(params->buf[i]) )
+        b->numSlots = b->numSlots ? b->numSlots * 2 : 1024;
+        free( b->slots );
+        b->slots = calloc( b->numSlots, sizeof( int ) );
+        for( k = 0; k < b->size; k++ )
         {
-            while( isalpha(params->buf[i]) )//skip until first non-alpha reached
-                ++i;
+            unsigned int s = (unsigned int)( (uintptr_t)b->words[k].entry >> 4 );
+            while( b->slots[s & ( b->numSlots - 1 )] )
+                ++s;
+            b->slots[s & ( b->numSlots - 1 )] = k + 1;
         }
     }
-    
-    while( i < maxRange )
+    unsigned int s = (unsigned int)( (uintptr_t)entry >> 4 );
+    while( ( k = b->slots[s & ( b->numSlots - 1 )] ) != 0 )
     {
-        if( isalpha(params->buf[i]) )
+        if( b->words[k - 1].entry == entry )
         {
-            char word[MAXWORDLEN];
-            int j = 0;
-            while( isalpha(params->buf[i]) )
-            {
-                word[j] = tolower( params->buf[i] );
-                ++j;
-                ++i;
-            }
-            if( j > 5 && j < MAXWORDLEN )
+            ++b->words[k - 1].wordCount;
+            return;
+        }
+        ++s;
+    }
+    if( b->size == b->max )
+    {
+        b->max = b->max ? b->max * 2 : 512;
+        b->words = realloc( b->words, b->max * sizeof( Ranked ) );
+    }
+    b->words[b->size] = (Ranked){ 1, cls, entry };
+    b->slots[s & ( b->numSlots - 1 )] = ++b->size;
+}
+
+/*
+ * This function adds every word of a batch to the table and the current time
+ * bucket and empties it. A word whose count in the window goes up from zero
+ * joins the live list
+ */
+void windowInsertBatch( Batch *batch )
+{
+    int k;
+    for( k = 0; k < batch->size; k++ )
+    {
+        const uint64_t *key = batch->key[k];
+        int cls = keyClass( batch->length[k] );
+        int words = 1 << cls;
+        HashEntry **bucket = &hashTable[cls][batch->hash[k] & ( HASHSIZE - 1 )];
+        HashEntry *tmp = *bucket;
+        while( tmp && !keyEquals( tmp->key, key, words ) )
+            tmp = tmp->next;
+        if( tmp == NULL )
+        {
+            tmp = newEntry( &globalArena, key, words );
+            tmp->next = *bucket;
+            *bucket = tmp;
+        }
+        if( tmp->wordCount++ == 0 )
+        {
+            if( numLive == maxLive )
             {
-                word[j] = '\0';
-                add( word, params->acceptableStatus );
+                maxLive = maxLive ? maxLive * 2 : 1024;
+                live = realloc( live, maxLive * sizeof( Ranked ) );
             }
+            live[numLive++] = (Ranked){ 0, cls, tmp };
         }
-        ++i;
+        bucketAdd( &window[currentBucket], tmp, cls );
     }
-    
-    if( ++deadThreads == MAXTHREADS )//all threads are now done
-   	{
-      	if( pthread_cond_signal( &cond ) != 0 )//wakeup master
-            fprintf( stderr, "error in cond_signal\n" );
-   	}
-    return 0;
+    batch->size = 0;
 }
 
 /*
- * This function begins building a c-style string off of the information passed
- * from it's calling function of the last byte read, the file descriptor, and
- * the buffer that the read function is using
+ * This function subtracts a time bucket that fell out of the window from the
+ * counts and empties it. The work is in the number of words in the bucket,
+ * not in the size of the table
  */
-int buildWord( int i, char *buf, int acceptableStatus )
+static void expireBucket( TimeBucket *b )
 {
-    char word[MAXWORDLEN];
-    int j = 0;
-    while( isalpha(buf[i]) )
+    int k;
+    for( k = 0; k < b->size; k++ )
+        b->words[k].entry->wordCount -= b->words[k].wordCount;
+    if( b->size )
+        memset( b->slots, 0, b->numSlots * sizeof( int ) );
+    b->size = 0;
+}
+
+/*
+ * This function drops the words whose count fell to zero from the live list
+ * and prints the top words of the window, or all of them with --all
+ */
+static void printWindow( void )
+{
+    TopK top;
+    int k, n = 0;
+    for( k = 0; k < numLive; k++ )
+        if( live[k].entry->wordCount > 0 )
+        {
+            live[n] = live[k];
+            live[n].wordCount = live[k].entry->wordCount;
+            ++n;
+        }
+    numLive = n;
+    if( dumpAll )
     {
-        word[j] = tolower( buf[i] );
-        ++j;
-        ++i;
+        Ranked *list = malloc( ( numLive + 1 ) * sizeof( Ranked ) );
+        memcpy( list, live, numLive * sizeof( Ranked ) );
+        qsort( list, numLive, sizeof( Ranked ), compareRanked );
+        printCounts( list, numLive, -1 );
+        free( list );
+        return;
+    }
+    memset( &top, 0, sizeof( top ) );
+    for( k = 0; k < numLive; k++ )
+        offerTopK( &top, live[k] );
+    Ranked *list = malloc( ( top.size + top.numTies + 1 ) * sizeof( Ranked ) );
+    memcpy( list, top.heap, top.size * sizeof( Ranked ) );
+    memcpy( list + top.size, top.ties, top.numTies * sizeof( Ranked ) );
+    qsort( list, top.size + top.numTies, sizeof( Ranked ), compareRanked );
+    printCounts( list, top.size + top.numTies, -1 );
+    free( list );
+    free( top.ties );
+}
+
+/*
+ * This function reads whatever was appended to a followed file since the last
+ * read and counts it into the current time bucket. Trailing letters are held
+ * back until the rest of the word arrives. A file that got shorter was
+ * truncated or replaced in place, and is read again from the start
+ */
+static void followRead( Follower *fl, char *buf, Batch *batch )
+{
+    struct stat st;
+    if( fstat( fl->fd, &st ) == 0 && st.st_size < fl->offset )
+    {
+        fl->offset = 0;
+        fl->carryLength = 0;
     }
-    if( j > 5 && j < MAXWORDLEN )
+    for( ;; )
     {
-        word[j] = '\0';
-        add( word, acceptableStatus );
+        memcpy( buf, fl->carry, fl->carryLength );
+        ssize_t r = pread( fl->fd, buf + fl->carryLength, READSIZE, fl->offset );
+        if( r <= 0 )
+            return;
+        fl->offset += r;
+        int n = fl->carryLength + (int)r;
+        int end = n;
+        while( end > 0 && n - end < MAXCARRY &&
+               ( isAsciiLetter( (unsigned char)buf[end - 1] ) ||
+                 (unsigned char)buf[end - 1] >= 0x80 ) )
+            --end;
+        if( n - end == MAXCARRY )//no word is that long, so it is not one
+            end = n;
+        buf[n] = '\0';
+        int i = 0;
+        while( i < end )
+        {
+            i = tokenize( i, end, buf, batch );
+            if( batch->size == BATCHSIZE )
+                windowInsertBatch( batch );
+        }
+        windowInsertBatch( batch );
+        fl->carryLength = n - end;
+        memcpy( fl->carry, buf + end, fl->carryLength );
+        if( r < READSIZE )
+            return;
     }
-    return i;
 }
 
 /*
- * This function adds the passed in word into the hash table, or, if the word
- * is already in the hash table, incriments that words count
+ * This function runs --follow mode. Each file is watched with inotify from
+ * its current end, and what is appended is counted into a ring of
+ * WINDOWBUCKETS time buckets spanning the last windowSecs seconds. Every time
+ * the ring moves on, the oldest bucket is subtracted from the counts and the
+ * top words of the window are printed. It runs until it is killed
  */
-void add( char *word, int acceptableStatus )
+void followFiles( )
 {
-    int hashIndex = hash( word );
-    if( acceptableStatus == 1 )
+    int f, ifd = inotify_init1( IN_CLOEXEC );
+    if( ifd == -1 )
+    {
+        fprintf( stderr, "can't start inotify\n" );
+        exit( -1 );
+    }
+    Follower *followers = calloc( numFiles, sizeof( Follower ) );
+    for( f = 0; f < numFiles; f++ )
     {
-        pthread_mutex_lock(&mutex);
-        if( hashTable[hashIndex] == NULL )//hashIndex empty
+        Follower *fl = &followers[f];
+        fl->fd = open( fileNames[f], O_RDONLY );
+        if( fl->fd == -1 )
         {
-            HashEntry *new = malloc( sizeof(HashEntry) );
-            strcpy( new->word, word );
-            new->next = new->prev = 0;
-            new->wordCount = 1;
-            new->status = 1;
-            if(pthread_mutex_init(&new->myMutex, NULL) != 0)
-                fprintf( stderr, "can't init mutex\n");
-            hashTable[hashIndex] = new;
+            fprintf( stderr, "Can't open %s for reading!\n", fileNames[f] );
+            exit( -1 );
         }
-        else
+        fl->offset = lseek( fl->fd, 0, SEEK_END );
+        fl->wd = inotify_add_watch( ifd, fileNames[f], IN_MODIFY );
+        if( fl->wd == -1 )
         {
-            HashEntry *tmp = hashTable[hashIndex];
-            while( tmp )
-            {
-                if( strcmp( tmp->word, word ) == 0 ) //word found at hashIndex
-                {
-                    tmp->wordCount = tmp->wordCount + 1;
-                    if( tmp->status == ( acceptableStatus - 1 ) )
-                        tmp->status = tmp->status + 1;
-                    break;
-                }
-                else if( tmp->next == 0 ) //word not found
-                {                                                  //at hashIndex
-                    HashEntry *new = malloc( sizeof(HashEntry) );
-                    strcpy( new->word, word );
-                    new->wordCount = 1;
-                    new->status = 1;
-                    if(pthread_mutex_init(&new->myMutex, NULL) != 0)
-                        fprintf( stderr, "can't init mutex\n");
-                    new->next = 0;
-                    new->prev = tmp;
-                    tmp->next = new;
-                    break;
-                }
-                else
-                    tmp = tmp->next;
-            }
+            fprintf( stderr, "can't watch %s\n", fileNames[f] );
+            exit( -1 );
         }
-        pthread_mutex_unlock(&mutex);
     }
-    else
+    char *buf = bigAlloc( MAXCARRY + READSIZE + 1 );
+    Batch *batch = malloc( sizeof( Batch ) );
+    char events[4096] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+    double width = (double)windowSecs / WINDOWBUCKETS;
+    double next = now( ) + width;
+    batch->size = 0;
+
+    for( ;; )
     {
-        HashEntry *tmp = hashTable[hashIndex];
-        while( tmp )
+        struct pollfd pfd = { ifd, POLLIN, 0 };
+        double wait = next - now( );
+        if( poll( &pfd, 1, wait > 0 ? (int)( wait * 1000 ) + 1 : 0 ) > 0 )
         {
-            if( strcmp( tmp->word, word ) == 0 ) //word found at hashIndex
+            ssize_t n = read( ifd, events, sizeof( events ) );
+            char *p = events;
+            while( p < events + n )
             {
-                pthread_mutex_lock(&tmp->myMutex);
-                tmp->wordCount = tmp->wordCount + 1;
-                if( tmp->status == ( acceptableStatus - 1 ) )
-                    tmp->status = tmp->status + 1;
-                pthread_mutex_unlock(&tmp->myMutex);
-                break;
+                const struct inotify_event *ev = (const struct inotify_event*)p;
+                for( f = 0; f < numFiles; f++ )
+                    if( followers[f].wd == ev->wd )
+                        followRead( &followers[f], buf, batch );
+                p += sizeof( struct inotify_event ) + ev->len;
             }
-            tmp = tmp->next;
         }
+        if( now( ) < next )
+            continue;
+        while( now( ) >= next )
+        {
+            currentBucket = ( currentBucket + 1 ) % WINDOWBUCKETS;
+            expireBucket( &window[currentBucket] );
+            next += width;
+        }
+        printWindow( );
+        fflush( stdout );
+    }
+}
+
+/*
+ * This function copies the word stored in a table entry into a c-style string
+ */
+void entryWord( const HashEntry *entry, int cls, char *word )
+{
+    int length = 8 << cls;
+    if( length >= MAXWORDLEN )
+        length = MAXWORDLEN - 1;
+    memcpy( word, entry->key, length );
+    word[length] = '\0';
+}
+
+/*
+ * This function orders two ranked words by count, highest first, and then
+ * alphabetically
+ */
+int compareRanked( const void *a, const void *b )
+{
+    const Ranked *x = a, *y = b;
+    char wx[MAXWORDLEN], wy[MAXWORDLEN];
+    if( x->wordCount != y->wordCount )
+        return x->wordCount > y->wordCount ? -1 : 1;
+    entryWord( x->entry, x->cls, wx );
+    entryWord( y->entry, y->cls, wy );
+    return strcmp( wx, wy );
+}
+
+/*
+ * This function writes a string as a quoted JSON string
+ */
+static void printJsonString( const char *s )
+{
+    putchar( '"' );
+    for( ; *s; s++ )
+    {
+        unsigned char c = (unsigned char)*s;
+        if( c == '"' || c == '\\' )
+            printf( "\\%c", c );
+        else if( c < 0x20 )
+            printf( "\\u%04x", c );
+        else
+            putchar( c );
     }
+    putchar( '"' );
 }
 
 /*
- * This is a hash function that returns a words index in the hash table
+ * This function writes a list as a --format binary header and records
  */
-int hash( char *word )
+static void printBinary( Ranked *list, int size, int file )
 {
-    char w[MAXWORDLEN];
-    strcpy( w, word );
-    int length = strlen(w);
-    unsigned int hash = 0;
+    DumpHeader header;
+    DumpRecord record;
     int i;
-    for( i = 0; i < length; i++ )
-        hash = 33 * hash ^ w[i];
-    
-    return hash & 0x7ff;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, DUMPMAGIC, sizeof( header.magic ) );
+    header.version = DUMPVERSION;
+    header.numWords = size;
+    header.file = file;
+    fwrite( &header, sizeof( header ), 1, stdout );
+    for( i = 0; i < size; i++ )
+    {
+        memset( &record, 0, sizeof( record ) );
+        entryWord( list[i].entry, list[i].cls, record.word );
+        record.count = list[i].wordCount;
+        record.length = strlen( record.word );
+        fwrite( &record, sizeof( record ), 1, stdout );
+    }
 }
 
 /*
- * This function goes through the entire hash table and prints out all of the
- * words and their counts. Only run after cleanup.
+ * This function prints out the words in the sorted list passed in, for the
+ * given file of a --per-file run or -1, in the --format asked for. Unless the
+ * whole list was asked for, only the top words and any ties with the last of
+ * them are printed. Only the text format leaves the counts out; JSON is one
+ * object per list on a line of its own
  */
-void printCounts( )
+void printCounts( Ranked *list, int size, int file )
 {
+    char word[MAXWORDLEN];
+    int i, n = size;
+    if( !dumpAll && n > MAXTOPWORDS )
+    {
+        n = MAXTOPWORDS;
+        while( n < size && list[n].wordCount == list[MAXTOPWORDS - 1].wordCount )
+            ++n;
+    }
+    switch( outputFormat )
+    {
+        case FORMAT_BINARY:
+            printBinary( list, n, file );
+            return;
+        case FORMAT_TSV:
+            for( i = 0; i < n; i++ )
+            {
+                entryWord( list[i].entry, list[i].cls, word );
+                if( file >= 0 )
+                    printf( "%s\t", fileNames[file] );
+                printf( "%s\t%u\n", word, list[i].wordCount );
+            }
+            return;
+        case FORMAT_JSON:
+            putchar( '{' );
+            if( file >= 0 )
+            {
+                printf( "\"file\":" );
+                printJsonString( fileNames[file] );
+                putchar( ',' );
+            }
+            printf( "\"words\":[" );
+            for( i = 0; i < n; i++ )
+            {
+                entryWord( list[i].entry, list[i].cls, word );
+                printf( "%s{\"word\":\"%s\",\"count\":%u}", i ? "," : "", word,
+                        list[i].wordCount );
+            }
+            printf( "]}\n" );
+            return;
+    }
+
+    if( file >= 0 )
+        fprintf( stdout, "%s:\n", fileNames[file] );
     fprintf(stdout, "----------------------------\n");
-	int i = 0;
-    HashEntry *tmp = head;
-    if( tmp == NULL )
+    if( size == 0 )
     {
-        fprintf(stdout, "No Words Found in All Files\n" );
-        exit(0);
+        if( followMode )
+            fprintf(stdout, "No Words Found in the Window\n" );
+        else if( insertAll )
+            fprintf(stdout, "No Matching Words Found\n" );
+        else
+            fprintf(stdout, "No Words Found in All Files\n" );
+        return;
     }
-    while( tmp != NULL && i < MAXTOPWORDS )
+    for( i = 0; i < n; i++ )
     {
-        fprintf( stdout, "#%d:\t%s\n", i+1, tmp->word );
-        tmp = tmp->next;
-        ++i;
+        entryWord( list[i].entry, list[i].cls, word );
+        fprintf( stdout, "#%d:\t%s\n", i+1, word );
     }
-    if( tmp && tmp->next )
+    fprintf(stdout, "----------------------------\n" );
+}
+
+/*
+ * This function turns a list of 1-based file positions and ranges such as
+ * "1,3-5" into a file bitmap. It returns NULL if the list is malformed
+ */
+uint64_t *parseFiles( const char *list )
+{
+    uint64_t *files = calloc( fileWords, sizeof( uint64_t ) );
+    const char *p = list;
+    for( ;; )
     {
-        while( tmp->next->wordCount == tmp->wordCount )
+        char *end;
+        long lo = strtol( p, &end, 10 ), hi = lo;
+        if( end == p )
+            break;
+        p = end;
+        if( *p == '-' )
         {
-            fprintf( stdout, "#%d:\t%s\n", i, tmp->word );
-            tmp = tmp->next;
+            hi = strtol( p + 1, &end, 10 );
+            if( end == p + 1 )
+                break;
+            p = end;
         }
+        if( lo < 1 || hi < lo || hi > numFiles )
+            break;
+        for( ; lo <= hi; lo++ )
+            files[( lo - 1 ) / 64] |= 1ULL << ( ( lo - 1 ) % 64 );
+        if( *p == '\0' )
+            return files;
+        if( *p++ != ',' )
+            break;
     }
-    fprintf(stdout, "----------------------------\n" );
-    exit(0);
+    fprintf( stderr, "bad file list: %s\n", list );
+    free( files );
+    return NULL;
+}
+
+/*
+ * This function checks a word's file bitmap against the presence filter: in
+ * at least minFiles files, in every file of --in and in no file of --not
+ */
+int matchesFiles( const uint64_t *files )
+{
+    int k, present = 0;
+    for( k = 0; k < fileWords; k++ )
+    {
+        if( inFiles && ( files[k] & inFiles[k] ) != inFiles[k] )
+            return 0;
+        if( notFiles && ( files[k] & notFiles[k] ) )
+            return 0;
+        present += __builtin_popcountll( files[k] );
+    }
+    return present >= minFiles;
+}
+
+/*
+ * This function merges every aggregation thread's top-K heap for the given
+ * file, or the overall one for -1, and prints the result
+ */
+static void printTop( int file )
+{
+    int i, size = 0;
+    for( i = 0; i < numThreads; i++ )
+    {
+        TopK *top = file < 0 ? &partitions[i].top : &partitions[i].fileTop[file];
+        size += top->size + top->numTies;
+    }
+    Ranked *merged = malloc( ( size + 1 ) * sizeof( Ranked ) );
+    size = 0;
+    for( i = 0; i < numThreads; i++ )
+    {
+        TopK *top = file < 0 ? &partitions[i].top : &partitions[i].fileTop[file];
+        memcpy( merged + size, top->heap, top->size * sizeof( Ranked ) );
+        size += top->size;
+        memcpy( merged + size, top->ties, top->numTies * sizeof( Ranked ) );
+        size += top->numTies;
+        free( top->ties );
+    }
+    qsort( merged, size, sizeof( Ranked ), compareRanked );
+    printCounts( merged, size, file );
+    free( merged );
 }
 
 /*
- * This function searches through the table for a list of all the words that
- * have been found in all files to be put into the print queue
+ * This function splits the table between numThreads aggregation threads, each
+ * of which filters its share for the words that pass the presence filter.
+ * Unless asked otherwise that means found in all acceptableStatus files that
+ * were counted. The per-thread top words are then merged, overall or for each
+ * file with --per-file, or with --all the threads go on to sort every match
+ * together, and the result is printed. Per-file lists rank the words found in
+ * the file by their count in that file
  */
 void processTable( int acceptableStatus )
 {
-    int i = 0;
-    while( i < HASHSIZE )
+    int buckets = KEYCLASSES * HASHSIZE;
+    int i;
+    if( minFiles < 0 )
+        minFiles = insertAll ? 1 : acceptableStatus;
+    if( pthread_barrier_init( &barrier, NULL, numThreads ) != 0 )
+        fprintf( stderr, "can't init barrier\n");
+    for( i = 0; i < numThreads; i++ )
     {
-        HashEntry *tmp = hashTable[i];
-        while( tmp )
-        {
-            if( tmp->status == acceptableStatus )
-                insertWCount( tmp );
-            tmp = tmp->next;
-        }
-        ++i;
+        Partition *part = &partitions[i];
+        memset( part, 0, sizeof( Partition ) );
+        part->id = i;
+        part->lo = (int)( (long)buckets * i / numThreads );
+        part->hi = (int)( (long)buckets * ( i + 1 ) / numThreads );
+        if( perFile )
+            part->fileTop = calloc( numFiles, sizeof( TopK ) );
     }
+    runThreads( aggregate, partitions, sizeof( Partition ) );
+    pthread_barrier_destroy( &barrier );
+
+    if( dumpAll )
+        printCounts( sorted, numSorted, -1 );
+    else if( perFile )
+    {
+        for( i = 0; i < numFiles; i++ )
+            printTop( i );
+    }
+    else
+        printTop( -1 );
 }
 
 /*
- * This function inserts the words found to be applicable for the print queue
- * into the print queue
+ * This function is run by each aggregation thread. It walks the thread's range
+ * of buckets and either offers each word that passes the presence filter to
+ * the thread's top-K heaps or, for --all, collects it for the parallel sort
  */
-void insertWCount( HashEntry *tmp )
+void* aggregate( void* p )
 {
-    HashEntry *new = malloc( sizeof( HashEntry ) );
-    strcpy(new->word, tmp->word);
-    new->wordCount = tmp->wordCount;
-    new->next = new->prev = 0;
-    
-    if( head != 0 )
+    Partition *part = (Partition*)p;
+    PerfThread *pt = perfStart( part->id );
+    int b;
+    for( b = part->lo; b < part->hi; b++ )
     {
-        HashEntry *scan = head;
-        while( scan != tail && scan->wordCount > new->wordCount )
-        {
-            scan = scan->next;
-        }
-        
-        if( scan == head && scan == tail )
+        int cls = b / HASHSIZE;
+        HashEntry *tmp = hashTable[cls][b % HASHSIZE];
+        while( tmp )
         {
-            if( new->wordCount > scan->wordCount )
+            if( matchesFiles( tmp->key + ( 1 << cls ) ) )
             {
-                new->next = head;
-                head->prev = new;
-                head = new;
-            }
-            else
-            {
-                new->prev = tail;
-                tail->next = new;
-                tail = new;
+                Ranked r = { tmp->wordCount, cls, tmp };
+                if( perFile )
+                {
+                    uint32_t *counts = fileCounts( tmp->key, 1 << cls );
+                    int f;
+                    for( f = 0; f < numFiles; f++ )
+                        if( counts[f] )
+                        {
+                            r.wordCount = counts[f];
+                            offerTopK( &part->fileTop[f], r );
+                        }
+                }
+                else if( !dumpAll )
+                    offerTopK( &part->top, r );
+                else
+                {
+                    if( part->numMatches == part->maxMatches )
+                    {
+                        part->maxMatches = part->maxMatches ?
+                                           part->maxMatches * 2 : 256;
+                        part->matches = realloc( part->matches,
+                                        part->maxMatches * sizeof( Ranked ) );
+                    }
+                    part->matches[part->numMatches++] = r;
+                    if( r.wordCount > part->maxCount )
+                        part->maxCount = r.wordCount;
+                }
             }
+            tmp = tmp->next;
         }
-        else if( scan == head )
+    }
+    if( dumpAll )
+        radixSort( part );
+    perfSwitch( pt, PHASE_AGGREGATE );
+    perfStop( pt );
+    return 0;
+}
+
+/*
+ * This function restores the heap order below index i, smallest count on top
+ */
+static void siftDown( TopK *top, int i )
+{
+    for( ;; )
+    {
+        int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if( l < top->size && top->heap[l].wordCount < top->heap[smallest].wordCount )
+            smallest = l;
+        if( r < top->size && top->heap[r].wordCount < top->heap[smallest].wordCount )
+            smallest = r;
+        if( smallest == i )
+            return;
+        Ranked t = top->heap[i];
+        top->heap[i] = top->heap[smallest];
+        top->heap[smallest] = t;
+        i = smallest;
+    }
+}
+
+/*
+ * This function keeps track of a tie with the smallest count in the heap
+ */
+static void addTie( TopK *top, Ranked r )
+{
+    if( top->numTies == top->maxTies )
+    {
+        top->maxTies = top->maxTies ? top->maxTies * 2 : 16;
+        top->ties = realloc( top->ties, top->maxTies * sizeof( Ranked ) );
+    }
+    top->ties[top->numTies++] = r;
+}
+
+/*
+ * This function offers a word to a thread's top-K heap. Words that tie the
+ * smallest count in a full heap are kept aside so ties can still be printed
+ * after the per-thread results are merged
+ */
+void offerTopK( TopK *top, Ranked r )
+{
+    if( top->size < MAXTOPWORDS )
+    {
+        int i = top->size++;
+        top->heap[i] = r;
+        while( i > 0 && top->heap[( i - 1 ) / 2].wordCount > top->heap[i].wordCount )
         {
-            new->next = head;
-            head->prev = new;
-            head = new;
+            Ranked t = top->heap[i];
+            top->heap[i] = top->heap[( i - 1 ) / 2];
+            top->heap[( i - 1 ) / 2] = t;
+            i = ( i - 1 ) / 2;
         }
-        else if( scan == tail )
+        return;
+    }
+    if( r.wordCount < top->heap[0].wordCount )
+        return;
+    if( r.wordCount == top->heap[0].wordCount )
+    {
+        addTie( top, r );
+        return;
+    }
+    Ranked evicted = top->heap[0];
+    top->heap[0] = r;
+    siftDown( top, 0 );
+    if( evicted.wordCount == top->heap[0].wordCount )
+        addTie( top, evicted );
+    else
+        top->numTies = 0;
+}
+
+/*
+ * This function sorts every partition's matches together, highest count
+ * first, with all of the aggregation threads taking part. Counts are sorted
+ * with a parallel LSD radix sort: per-thread digit histograms, a prefix sum
+ * and a scatter per byte of the largest count. Runs of equal counts are then
+ * put in alphabetical order by whichever thread owns the start of the run.
+ * Every thread finds where the runs in its share start before any of them
+ * sorts one, as a run can reach into the shares of the threads after it
+ */
+void radixSort( Partition *part )
+{
+    int t, d, i;
+    int offset = 0;
+    uint32_t maxCount = 0;
+
+    pthread_barrier_wait( &barrier );
+    for( t = 0; t < numThreads; t++ )
+    {
+        if( t < part->id )
+            offset += partitions[t].numMatches;
+        if( partitions[t].maxCount > maxCount )
+            maxCount = partitions[t].maxCount;
+    }
+    if( part->id == 0 )
+    {
+        numSorted = 0;
+        for( t = 0; t < numThreads; t++ )
+            numSorted += partitions[t].numMatches;
+        sorted = malloc( ( numSorted + 1 ) * sizeof( Ranked ) );
+        scratch = malloc( ( numSorted + 1 ) * sizeof( Ranked ) );
+    }
+    pthread_barrier_wait( &barrier );
+
+    memcpy( sorted + offset, part->matches, part->numMatches * sizeof( Ranked ) );
+    free( part->matches );
+    int lo = (int)( (long)numSorted * part->id / numThreads );
+    int hi = (int)( (long)numSorted * ( part->id + 1 ) / numThreads );
+    Ranked *src = sorted, *dst = scratch;
+    int shift;
+    for( shift = 0; shift < 32 && ( maxCount >> shift ) != 0; shift += 8 )
+    {
+        pthread_barrier_wait( &barrier );
+        memset( part->hist, 0, sizeof( part->hist ) );
+        for( i = lo; i < hi; i++ )
+            part->hist[255 - ( ( src[i].wordCount >> shift ) & 0xff )]++;
+        pthread_barrier_wait( &barrier );
+
+        int pos[256];
+        offset = 0;
+        for( d = 0; d < 256; d++ )
         {
-            if( scan->wordCount > new->wordCount )
-            {
-                new->prev = tail;
-                tail->next = new;
-                tail = new;
-            }
-            else
+            for( t = 0; t < numThreads; t++ )
             {
-                new->next = tail;
-                new->prev = tail->prev;
-                if( tail->prev )
-                    tail->prev->next = new;
-                tail->prev = new;
+                if( t == part->id )
+                    pos[d] = offset;
+                offset += partitions[t].hist[d];
             }
         }
-        else
+        for( i = lo; i < hi; i++ )
+            dst[pos[255 - ( ( src[i].wordCount >> shift ) & 0xff )]++] = src[i];
+        Ranked *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    pthread_barrier_wait( &barrier );
+    if( part->id == 0 && src != sorted )
+        memcpy( sorted, src, numSorted * sizeof( Ranked ) );
+    pthread_barrier_wait( &barrier );
+
+    i = lo;
+    if( i > 0 )
+        while( i < hi && sorted[i].wordCount == sorted[i - 1].wordCount )
+            ++i;
+    part->firstRun = i < hi ? i : -1;
+    pthread_barrier_wait( &barrier );
+
+    int last = numSorted;
+    for( t = part->id + 1; t < numThreads; t++ )
+        if( partitions[t].firstRun >= 0 )
         {
-            new->next = scan;
-            new->prev = scan->prev;
-            if( scan->prev )
-                scan->prev->next = new;
-            
-            scan->prev = new;  
+            last = partitions[t].firstRun;
+            break;
         }
+    if( part->firstRun < 0 )
+        i = last;
+    while( i < last )
+    {
+        int end = i + 1;
+        while( end < last && sorted[end].wordCount == sorted[i].wordCount )
+            ++end;
+        if( end - i > 1 )
+            qsort( sorted + i, end - i, sizeof( Ranked ), compareRanked );
+        i = end;
     }
-    else
-        head = tail = new;
-}
\ No newline at end of file
+}
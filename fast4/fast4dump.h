@@ -0,0 +1,38 @@
+//  fast4dump.h
+//  fast4
+//
+//  Layout of the lists fast4 writes with --format binary, for tools that
+//  map the output and read it in place. Each list is a header followed by
+//  numWords fixed size records, highest count first and alphabetical among
+//  equal counts. A --per-file run writes one list per file and --follow one
+//  per window, one after another. Everything is in the byte order of the
+//  machine that wrote it.
+//
+
+#ifndef FAST4DUMP_H
+#define FAST4DUMP_H
+
+#include <stdint.h>
+
+#define DUMPMAGIC "F4WB"
+#define DUMPVERSION 1
+#define DUMPWORDLEN 51
+
+struct DumpHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t numWords;
+    int32_t  file;              // position of the file in a --per-file run, or -1
+};
+
+/*
+ * A word and its count. The word is length bytes of UTF-8, zero padded, so
+ * it can also be used as a c-style string
+ */
+struct DumpRecord {
+    uint32_t count;
+    uint8_t  length;
+    char     word[DUMPWORDLEN];
+};
+
+#endif
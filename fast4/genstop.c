@@ -0,0 +1,129 @@
+//  genstop.c
+//  fast4
+//
+//  Builds the perfect hash table of stop words in stopwords.h from the list
+//  in stopwords.txt. Each word lands in its own slot of a power of two table
+//  at ( hash * STOPMUL ) >> ( 32 - STOPBITS ), so fast4 needs one probe and
+//  one key compare per token, with the hash it already computed. Slots hold
+//  the index of the word plus one, so the table itself stays small.
+//
+//  usage: genstop < stopwords.txt > stopwords.h
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "wordhash.h"
+
+#define MAXWORDLEN 50
+#define MAXSTOPWORDS 4096
+#define MAXTRIES 1000000
+
+char words[MAXSTOPWORDS][MAXWORDLEN];
+unsigned int hashes[MAXSTOPWORDS];
+int numWords = 0;
+
+/*
+ * This function reads the list, lowercasing each word and skipping comments,
+ * blank lines and words fast4 would never count
+ */
+void readWords( void )
+{
+    char line[256];
+    while( fgets( line, sizeof( line ), stdin ) )
+    {
+        int j = 0, k;
+        uint64_t key[8] = { 0 };
+        if( line[0] == '#' )
+            continue;
+        while( isalpha( (unsigned char)line[j] ) && j < MAXWORDLEN )
+        {
+            line[j] = tolower( (unsigned char)line[j] );
+            ++j;
+        }
+        line[j] = '\0';
+        if( j == 0 )
+            continue;
+        if( j < 6 || j >= MAXWORDLEN )
+        {
+            fprintf( stderr, "skipping %s: fast4 only counts 6 to %d letters\n",
+                     line, MAXWORDLEN - 1 );
+            continue;
+        }
+        for( k = 0; k < numWords; k++ )
+            if( strcmp( words[k], line ) == 0 )
+                break;
+        if( k < numWords )
+            continue;
+        if( numWords == MAXSTOPWORDS )
+        {
+            fprintf( stderr, "too many stop words\n" );
+            exit( -1 );
+        }
+        memcpy( key, line, j );
+        strcpy( words[numWords], line );
+        hashes[numWords++] = hash( key, keyWords( j ) );
+    }
+}
+
+/*
+ * This function looks for an odd multiplier that sends every word to its own
+ * slot of a table with 1 << bits slots. It returns 0 if none was found
+ */
+unsigned int findMultiplier( int bits )
+{
+    static unsigned char used[1 << 16];
+    unsigned int seed = 12345;
+    int t, k;
+    for( t = 0; t < MAXTRIES; t++ )
+    {
+        seed = seed * 1664525u + 1013904223u;
+        unsigned int mul = seed | 1;
+        memset( used, 0, 1 << bits );
+        for( k = 0; k < numWords; k++ )
+        {
+            unsigned int slot = ( hashes[k] * mul ) >> ( 32 - bits );
+            if( used[slot] )
+                break;
+            used[slot] = 1;
+        }
+        if( k == numWords )
+            return mul;
+    }
+    return 0;
+}
+
+int main( )
+{
+    int bits = 1, k;
+    unsigned int mul = 0;
+    readWords( );
+    while( ( 1 << bits ) < 2 * numWords )
+        ++bits;
+    while( bits <= 16 && ( mul = findMultiplier( bits ) ) == 0 )
+        ++bits;
+    if( mul == 0 )
+    {
+        fprintf( stderr, "no perfect hash found\n" );
+        return -1;
+    }
+
+    printf( "//  stopwords.h\n" );
+    printf( "//  fast4\n" );
+    printf( "//\n" );
+    printf( "//  Generated by genstop from stopwords.txt, do not edit. The slots\n" );
+    printf( "//  depend on the byte order of the machine it was generated on.\n" );
+    printf( "//\n\n" );
+    printf( "#define STOPBITS %d\n", bits );
+    printf( "#define STOPMUL 0x%08xu\n\n", mul );
+    printf( "static const StopWord stopWords[%d] = {\n", numWords );
+    for( k = 0; k < numWords; k++ )
+        printf( "    { %d, { \"%s\" } },\n", (int)strlen( words[k] ), words[k] );
+    printf( "};\n\n" );
+    printf( "static const unsigned short stopSlots[1 << STOPBITS] = {\n" );
+    for( k = 0; k < numWords; k++ )
+        printf( "    [%u] = %d,\n", ( hashes[k] * mul ) >> ( 32 - bits ), k + 1 );
+    printf( "};\n" );
+    return 0;
+}
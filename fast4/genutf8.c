@@ -0,0 +1,131 @@
+//  genutf8.c
+//  fast4
+//
+//  Builds the Unicode tables in utf8tables.h from the C library's C.UTF-8
+//  locale. Letters are a bitmap split into 256 code point blocks and case
+//  folding is a table of deltas split into 128 code point blocks; a first
+//  level maps each block to one of the distinct blocks, so the thousands of
+//  blocks without letters or capitals all share a single copy. Folding is
+//  the simple one to one kind, the lowercase of each letter.
+//
+//  usage: genutf8 > utf8tables.h
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <locale.h>
+#include <wctype.h>
+
+#define MAXCODE 0x110000
+#define LETTERSHIFT 8
+#define FOLDSHIFT 7
+#define MAXBLOCKS 256
+
+unsigned char letterIndex[MAXCODE >> LETTERSHIFT];
+unsigned char letterBits[MAXBLOCKS][( 1 << LETTERSHIFT ) / 8];
+int numLetterBlocks = 0;
+
+unsigned char foldIndex[MAXCODE >> FOLDSHIFT];
+int32_t foldDelta[MAXBLOCKS][1 << FOLDSHIFT];
+int numFoldBlocks = 0;
+
+/*
+ * This function returns the index of a block equal to the given one among
+ * the first *count blocks of a table, adding it at the end if there is none
+ */
+int findBlock( void *table, int *count, const void *block, size_t size )
+{
+    int k;
+    for( k = 0; k < *count; k++ )
+        if( memcmp( (char*)table + k * size, block, size ) == 0 )
+            return k;
+    if( *count == MAXBLOCKS )
+    {
+        fprintf( stderr, "too many distinct blocks\n" );
+        exit( -1 );
+    }
+    memcpy( (char*)table + k * size, block, size );
+    return (*count)++;
+}
+
+/*
+ * This function prints a table of bytes as a C array body, 16 to a line
+ */
+void printBytes( const unsigned char *v, int n )
+{
+    int k;
+    for( k = 0; k < n; k++ )
+        printf( "%s0x%02x,%s", k % 16 == 0 ? "    " : " ", v[k],
+                k % 16 == 15 || k == n - 1 ? "\n" : "" );
+}
+
+int main( )
+{
+    int b, k;
+    if( !setlocale( LC_CTYPE, "C.UTF-8" ) )
+    {
+        fprintf( stderr, "the C.UTF-8 locale is not available\n" );
+        return -1;
+    }
+
+    for( b = 0; b < MAXCODE >> LETTERSHIFT; b++ )
+    {
+        unsigned char bits[( 1 << LETTERSHIFT ) / 8] = { 0 };
+        for( k = 0; k < 1 << LETTERSHIFT; k++ )
+            if( iswalpha( ( b << LETTERSHIFT ) + k ) )
+                bits[k >> 3] |= 1 << ( k & 7 );
+        letterIndex[b] = findBlock( letterBits, &numLetterBlocks, bits,
+                                    sizeof( bits ) );
+    }
+    for( b = 0; b < MAXCODE >> FOLDSHIFT; b++ )
+    {
+        int32_t delta[1 << FOLDSHIFT] = { 0 };
+        for( k = 0; k < 1 << FOLDSHIFT; k++ )
+        {
+            wint_t c = ( b << FOLDSHIFT ) + k;
+            if( iswalpha( c ) )
+                delta[k] = (int32_t)towlower( c ) - (int32_t)c;
+        }
+        foldIndex[b] = findBlock( foldDelta, &numFoldBlocks, delta,
+                                  sizeof( delta ) );
+    }
+
+    printf( "//  utf8tables.h\n" );
+    printf( "//  fast4\n" );
+    printf( "//\n" );
+    printf( "//  Generated by genutf8 from the C.UTF-8 locale, do not edit.\n" );
+    printf( "//\n\n" );
+    printf( "#define LETTERSHIFT %d\n", LETTERSHIFT );
+    printf( "#define FOLDSHIFT %d\n\n", FOLDSHIFT );
+    printf( "static const unsigned char letterIndex[0x%x] = {\n",
+            MAXCODE >> LETTERSHIFT );
+    printBytes( letterIndex, MAXCODE >> LETTERSHIFT );
+    printf( "};\n\n" );
+    printf( "static const unsigned char letterBits[%d][%d] = {\n",
+            numLetterBlocks, ( 1 << LETTERSHIFT ) / 8 );
+    for( b = 0; b < numLetterBlocks; b++ )
+    {
+        printf( "  {\n" );
+        printBytes( letterBits[b], ( 1 << LETTERSHIFT ) / 8 );
+        printf( "  },\n" );
+    }
+    printf( "};\n\n" );
+    printf( "static const unsigned char foldIndex[0x%x] = {\n",
+            MAXCODE >> FOLDSHIFT );
+    printBytes( foldIndex, MAXCODE >> FOLDSHIFT );
+    printf( "};\n\n" );
+    printf( "static const int32_t foldDelta[%d][%d] = {\n", numFoldBlocks,
+            1 << FOLDSHIFT );
+    for( b = 0; b < numFoldBlocks; b++ )
+    {
+        printf( "  {\n" );
+        for( k = 0; k < 1 << FOLDSHIFT; k++ )
+            printf( "%s%d,%s", k % 8 == 0 ? "    " : " ", foldDelta[b][k],
+                    k % 8 == 7 ? "\n" : "" );
+        printf( "  },\n" );
+    }
+    printf( "};\n" );
+    return 0;
+}
@@ -0,0 +1,193 @@
+//  stopwords.h
+//  fast4
+//
+//  Generated by genstop from stopwords.txt, do not edit. The slots
+//  depend on the byte order of the machine it was generated on.
+//
+
+#define STOPBITS 9
+#define STOPMUL 0xb9b6510du
+
+static const StopWord stopWords[89] = {
+    { 6, { "across" } },
+    { 8, { "actually" } },
+    { 7, { "against" } },
+    { 6, { "almost" } },
+    { 7, { "already" } },
+    { 8, { "although" } },
+    { 6, { "always" } },
+    { 7, { "amongst" } },
+    { 7, { "another" } },
+    { 6, { "anyone" } },
+    { 8, { "anything" } },
+    { 6, { "anyway" } },
+    { 8, { "anywhere" } },
+    { 6, { "around" } },
+    { 6, { "became" } },
+    { 7, { "because" } },
+    { 6, { "become" } },
+    { 7, { "becomes" } },
+    { 6, { "before" } },
+    { 6, { "behind" } },
+    { 6, { "beside" } },
+    { 7, { "besides" } },
+    { 7, { "between" } },
+    { 6, { "beyond" } },
+    { 6, { "cannot" } },
+    { 7, { "certain" } },
+    { 6, { "couldn" } },
+    { 6, { "during" } },
+    { 6, { "either" } },
+    { 6, { "enough" } },
+    { 10, { "especially" } },
+    { 8, { "everyone" } },
+    { 10, { "everything" } },
+    { 10, { "everywhere" } },
+    { 6, { "except" } },
+    { 7, { "further" } },
+    { 6, { "hardly" } },
+    { 6, { "having" } },
+    { 7, { "herself" } },
+    { 7, { "himself" } },
+    { 7, { "however" } },
+    { 6, { "indeed" } },
+    { 7, { "instead" } },
+    { 6, { "itself" } },
+    { 6, { "little" } },
+    { 6, { "mainly" } },
+    { 6, { "merely" } },
+    { 6, { "mostly" } },
+    { 6, { "myself" } },
+    { 7, { "neither" } },
+    { 7, { "nothing" } },
+    { 6, { "others" } },
+    { 9, { "otherwise" } },
+    { 9, { "ourselves" } },
+    { 7, { "perhaps" } },
+    { 6, { "rather" } },
+    { 6, { "really" } },
+    { 6, { "seemed" } },
+    { 7, { "seeming" } },
+    { 7, { "several" } },
+    { 6, { "should" } },
+    { 7, { "shouldn" } },
+    { 9, { "something" } },
+    { 9, { "sometimes" } },
+    { 8, { "somewhat" } },
+    { 9, { "somewhere" } },
+    { 10, { "themselves" } },
+    { 9, { "therefore" } },
+    { 6, { "though" } },
+    { 7, { "through" } },
+    { 10, { "throughout" } },
+    { 8, { "together" } },
+    { 6, { "toward" } },
+    { 7, { "towards" } },
+    { 6, { "unless" } },
+    { 6, { "unlike" } },
+    { 8, { "unlikely" } },
+    { 8, { "whatever" } },
+    { 8, { "whenever" } },
+    { 7, { "whereas" } },
+    { 8, { "wherever" } },
+    { 7, { "whether" } },
+    { 9, { "whichever" } },
+    { 6, { "within" } },
+    { 7, { "without" } },
+    { 7, { "whoever" } },
+    { 6, { "wouldn" } },
+    { 8, { "yourself" } },
+    { 10, { "yourselves" } },
+};
+
+static const unsigned short stopSlots[1 << STOPBITS] = {
+    [150] = 1,
+    [9] = 2,
+    [47] = 3,
+    [464] = 4,
+    [133] = 5,
+    [396] = 6,
+    [100] = 7,
+    [359] = 8,
+    [450] = 9,
+    [345] = 10,
+    [462] = 11,
+    [222] = 12,
+    [224] = 13,
+    [290] = 14,
+    [288] = 15,
+    [28] = 16,
+    [465] = 17,
+    [332] = 18,
+    [142] = 19,
+    [247] = 20,
+    [81] = 21,
+    [460] = 22,
+    [260] = 23,
+    [103] = 24,
+    [78] = 25,
+    [172] = 26,
+    [342] = 27,
+    [253] = 28,
+    [190] = 29,
+    [283] = 30,
+    [373] = 31,
+    [77] = 32,
+    [499] = 33,
+    [216] = 34,
+    [353] = 35,
+    [379] = 36,
+    [268] = 37,
+    [505] = 38,
+    [331] = 39,
+    [326] = 40,
+    [365] = 41,
+    [12] = 42,
+    [382] = 43,
+    [18] = 44,
+    [204] = 45,
+    [440] = 46,
+    [360] = 47,
+    [91] = 48,
+    [64] = 49,
+    [141] = 50,
+    [86] = 51,
+    [183] = 52,
+    [234] = 53,
+    [90] = 54,
+    [1] = 55,
+    [0] = 56,
+    [448] = 57,
+    [68] = 58,
+    [480] = 59,
+    [471] = 60,
+    [466] = 61,
+    [473] = 62,
+    [194] = 63,
+    [320] = 64,
+    [477] = 65,
+    [249] = 66,
+    [510] = 67,
+    [487] = 68,
+    [119] = 69,
+    [109] = 70,
+    [30] = 71,
+    [313] = 72,
+    [188] = 73,
+    [55] = 74,
+    [164] = 75,
+    [46] = 76,
+    [127] = 77,
+    [43] = 78,
+    [186] = 79,
+    [329] = 80,
+    [203] = 81,
+    [189] = 82,
+    [368] = 83,
+    [196] = 84,
+    [208] = 85,
+    [383] = 86,
+    [123] = 87,
+    [316] = 88,
+    [377] = 89,
+};
@@ -0,0 +1,191 @@
+//  gencorpus.c
+//  fast4
+//
+//  Writes a reproducible test corpus of about the given number of bytes to
+//  stdout. The kinds are:
+//
+//    ascii   words from a skewed vocabulary, in mixed case, with punctuation
+//    utf8    words from several scripts, including letters whose lowercase
+//            is longer or shorter in UTF-8, non-letter symbols, and bytes
+//            that are not well formed UTF-8
+//    long    words of 40 to 60 bytes around the 49 byte limit, some of them
+//            with two and three byte letters
+//    edges   short words packed tightly, so any chunk boundary lands inside
+//            a word or right next to one
+//    prefix  words glued together from a few stems and parts, like the names
+//            in log lines, so many words share long beginnings
+//
+//  usage: gencorpus ascii|utf8|long|edges|prefix bytes seed
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define VOCABULARY 4096
+#define MAXWORD 256
+
+uint64_t state;
+
+unsigned int next( void )
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (unsigned int)( state >> 16 );
+}
+
+/*
+ * This function picks an index below n, the low ones far more often
+ */
+int skewed( int n )
+{
+    double u = ( next( ) % 1000000 ) / 1000000.0;
+    return (int)( n * u * u * u );
+}
+
+// letters of the utf8 corpus: ASCII, Latin-1, Greek, Cyrillic, and a few
+// whose lowercase changes length: capital A with stroke (2 bytes, lowercase
+// 3), Kelvin sign (3 bytes, lowercase 1) and Deseret (4 bytes)
+const char *letters[] = {
+    "a", "b", "c", "d", "e", "f", "g", "h", "i", "k", "l", "m", "n", "o",
+    "p", "r", "s", "t", "u", "w", "E", "T", "\xc3\xa9", "\xc3\xa8", "\xc3\xa7",
+    "\xc3\xb6", "\xc3\xbc", "\xc3\x9f", "\xc3\x89", "\xc3\x96", "\xc3\x9c",
+    "\xce\xb1", "\xce\xb2", "\xce\xb3", "\xcf\x83", "\xcf\x82", "\xce\xa3",
+    "\xce\xa9", "\xd0\xb0", "\xd0\xb1", "\xd0\xb2", "\xd1\x8f", "\xd0\x96",
+    "\xd0\xaf", "\xc8\xba", "\xe2\x84\xaa", "\xf0\x90\x90\x80",
+    "\xf0\x90\x90\xa8"
+};
+
+// separators of the utf8 corpus, with non-letter symbols and broken UTF-8
+const char *separators[] = {
+    " ", " ", " ", ", ", ".\n", "\n", " 42 ", "\xe2\x80\x94", "\xc2\xa0",
+    "\xc2\xab", "\xe2\x82\xac", "\xff", "\x80", "\xe2\x82", "\xc0\xaf",
+    "\xed\xa0\x80", "\x00"
+};
+
+#define NUMLETTERS ( sizeof( letters ) / sizeof( letters[0] ) )
+#define NUMSEPARATORS ( sizeof( separators ) / sizeof( separators[0] ) )
+
+char vocabulary[VOCABULARY][MAXWORD];
+
+void ascii( long bytes )
+{
+    static const char *punct[] = { " ", " ", " ", ", ", ".\n", "\n", " - ",
+                                   "'", " 123 ", "_" };
+    long written = 0;
+    int k, j;
+    for( k = 0; k < VOCABULARY; k++ )
+    {
+        int n = 1 + next( ) % 14;
+        for( j = 0; j < n; j++ )
+            vocabulary[k][j] = 'a' + next( ) % 26;
+        vocabulary[k][n] = '\0';
+    }
+    while( written < bytes )
+    {
+        char word[MAXWORD];
+        strcpy( word, vocabulary[skewed( VOCABULARY )] );
+        switch( next( ) % 10 )
+        {
+            case 0:
+                for( j = 0; word[j]; j++ )
+                    word[j] -= 'a' - 'A';
+                break;
+            case 1:
+            case 2:
+                word[0] -= 'a' - 'A';
+                break;
+        }
+        const char *p = punct[next( ) % 10];
+        written += printf( "%s%s", word, p );
+    }
+}
+
+/*
+ * This function writes words made of the utf8 letters, with byte lengths
+ * between min and max, separated by the utf8 separators
+ */
+void scripts( long bytes, int numWords, int min, int max )
+{
+    static char words[VOCABULARY][MAXWORD];
+    long written = 0;
+    int k;
+    for( k = 0; k < numWords; k++ )
+    {
+        int target = min + next( ) % ( max - min + 1 );
+        words[k][0] = '\0';
+        while( (int)strlen( words[k] ) < target )
+            strcat( words[k], letters[next( ) % NUMLETTERS] );
+    }
+    while( written < bytes )
+    {
+        const char *word = words[skewed( numWords )];
+        const char *sep = separators[next( ) % NUMSEPARATORS];
+        int n = sep[0] ? (int)strlen( sep ) : 1;
+        fputs( word, stdout );
+        fwrite( sep, 1, n, stdout );
+        written += strlen( word ) + n;
+    }
+}
+
+void edges( long bytes )
+{
+    static const char *words[] = { "abcde", "abcdef", "abcdefg", "Abcdefgh",
+                                   "zyxwvutsrq", "\xc3\xa9\xc3\xa9\xc3\xa9xyz" };
+    long written = 0;
+    while( written < bytes )
+        written += printf( "%s%s", words[next( ) % 6], next( ) % 4 ? " " : "." );
+}
+
+void prefixed( long bytes )
+{
+    static const char *stems[] = { "connection", "transaction", "replication",
+                                   "authentication", "configuration", "request",
+                                   "sessionmanager", "r\xc3\xa9plication" };
+    static const char *parts[] = { "start", "started", "stop", "stopped", "fail",
+                                   "failed", "timeout", "retry", "handler",
+                                   "pool", "queue", "closed", "reset", "error",
+                                   "s", "x", "State", "\xc3\xa9tat" };
+    long written = 0;
+    int k, j;
+    for( k = 0; k < VOCABULARY; k++ )
+    {
+        int n = next( ) % 4;
+        strcpy( vocabulary[k], stems[next( ) % 8] );
+        for( j = 0; j < n; j++ )
+            strcat( vocabulary[k], parts[next( ) % 18] );
+    }
+    while( written < bytes )
+        written += printf( "%s%s", vocabulary[skewed( VOCABULARY )],
+                           next( ) % 8 ? " " : ": " );
+}
+
+int main( int argc, char *argv[] )
+{
+    long bytes;
+    if( argc != 4 )
+    {
+        fprintf( stderr, "usage: %s ascii|utf8|long|edges|prefix bytes seed\n", argv[0] );
+        return 1;
+    }
+    bytes = atol( argv[2] );
+    state = 0x9e3779b97f4a7c15ULL ^ strtoull( argv[3], NULL, 10 );
+    if( strcmp( argv[1], "ascii" ) == 0 )
+        ascii( bytes );
+    else if( strcmp( argv[1], "utf8" ) == 0 )
+        scripts( bytes, VOCABULARY, 1, 24 );
+    else if( strcmp( argv[1], "long" ) == 0 )
+        scripts( bytes, 64, 40, 60 );
+    else if( strcmp( argv[1], "edges" ) == 0 )
+        edges( bytes );
+    else if( strcmp( argv[1], "prefix" ) == 0 )
+        prefixed( bytes );
+    else
+    {
+        fprintf( stderr, "unknown corpus %s\n", argv[1] );
+        return 1;
+    }
+    return 0;
+}
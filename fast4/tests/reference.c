@@ -0,0 +1,286 @@
+//  reference.c
+//  fast4
+//
+//  A plain single-threaded word counter that the test suite holds fast4 to.
+//  It goes through each file one code point at a time and keeps every word
+//  in a chained hash table of strings, with none of fast4's batching, key
+//  classes or threads. Only the Unicode tables are shared with fast4.
+//
+//  A word is a run of letters, folded to lowercase, with at least six
+//  letters and at most 49 bytes of UTF-8 once folded. Bytes that are not
+//  well formed UTF-8 separate words. The words found in at least K files,
+//  all of them by default, are printed as word and count separated by a
+//  tab, highest count first and then in byte order.
+//
+//  usage: reference [-k K] [-s stopwords.txt] file...
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "../utf8tables.h"
+
+#define MAXWORDLEN 50
+#define TABLESIZE ( 1 << 16 )
+
+struct Word {
+    struct Word *next;
+    long    count;
+    int     files;
+    int     lastFile;
+    int     stop;
+    char    word[];
+};
+
+struct Word *table[TABLESIZE];
+struct Word **words;
+long numWords = 0;
+
+/*
+ * This function finds a word in the table, adding it if it is not there
+ */
+struct Word *lookup( const char *word )
+{
+    unsigned int h = 5381;
+    const unsigned char *p;
+    struct Word *w;
+    for( p = (const unsigned char*)word; *p; p++ )
+        h = h * 33 + *p;
+    for( w = table[h % TABLESIZE]; w; w = w->next )
+        if( strcmp( w->word, word ) == 0 )
+            return w;
+    w = calloc( 1, sizeof( struct Word ) + strlen( word ) + 1 );
+    strcpy( w->word, word );
+    w->lastFile = -1;
+    w->next = table[h % TABLESIZE];
+    table[h % TABLESIZE] = w;
+    words = realloc( words, ( numWords + 1 ) * sizeof( *words ) );
+    words[numWords++] = w;
+    return w;
+}
+
+/*
+ * This function decodes one code point starting at s, n bytes before the end
+ * of the file. It returns the number of bytes used, or 0 if they are not
+ * well formed UTF-8
+ */
+int decode( const unsigned char *s, long n, unsigned int *c )
+{
+    int length, k;
+    unsigned int min;
+    if( s[0] < 0x80 )
+    {
+        *c = s[0];
+        return 1;
+    }
+    else if( ( s[0] & 0xe0 ) == 0xc0 )
+    {
+        length = 2;
+        min = 0x80;
+        *c = s[0] & 0x1f;
+    }
+    else if( ( s[0] & 0xf0 ) == 0xe0 )
+    {
+        length = 3;
+        min = 0x800;
+        *c = s[0] & 0x0f;
+    }
+    else if( ( s[0] & 0xf8 ) == 0xf0 )
+    {
+        length = 4;
+        min = 0x10000;
+        *c = s[0] & 0x07;
+    }
+    else
+        return 0;
+    if( n < length )
+        return 0;
+    for( k = 1; k < length; k++ )
+    {
+        if( ( s[k] & 0xc0 ) != 0x80 )
+            return 0;
+        *c = *c << 6 | ( s[k] & 0x3f );
+    }
+    if( *c < min || *c > 0x10ffff || ( *c >= 0xd800 && *c <= 0xdfff ) )
+        return 0;
+    return length;
+}
+
+int isLetter( unsigned int c )
+{
+    return ( letterBits[letterIndex[c >> LETTERSHIFT]][( c & 0xff ) / 8] >>
+             ( c % 8 ) ) & 1;
+}
+
+unsigned int fold( unsigned int c )
+{
+    return c + foldDelta[foldIndex[c >> FOLDSHIFT]][c % ( 1 << FOLDSHIFT )];
+}
+
+/*
+ * This function appends a code point to a word as UTF-8, as long as the word
+ * has room, and returns the word's new length in bytes
+ */
+int append( char *word, int length, unsigned int c )
+{
+    unsigned char buf[4];
+    int n, k;
+    if( c < 0x80 )
+    {
+        buf[0] = c;
+        n = 1;
+    }
+    else if( c < 0x800 )
+    {
+        buf[0] = 0xc0 | ( c >> 6 );
+        buf[1] = 0x80 | ( c & 0x3f );
+        n = 2;
+    }
+    else if( c < 0x10000 )
+    {
+        buf[0] = 0xe0 | ( c >> 12 );
+        buf[1] = 0x80 | ( ( c >> 6 ) & 0x3f );
+        buf[2] = 0x80 | ( c & 0x3f );
+        n = 3;
+    }
+    else
+    {
+        buf[0] = 0xf0 | ( c >> 18 );
+        buf[1] = 0x80 | ( ( c >> 12 ) & 0x3f );
+        buf[2] = 0x80 | ( ( c >> 6 ) & 0x3f );
+        buf[3] = 0x80 | ( c & 0x3f );
+        n = 4;
+    }
+    for( k = 0; k < n; k++ )
+        if( length + k < MAXWORDLEN )
+            word[length + k] = buf[k];
+    return length + n;
+}
+
+/*
+ * This function counts a finished word of the given file
+ */
+void finish( char *word, int length, int letters, int file )
+{
+    if( letters < 6 || length > MAXWORDLEN - 1 )
+        return;
+    word[length] = '\0';
+    struct Word *w = lookup( word );
+    w->count++;
+    if( w->lastFile != file )
+    {
+        w->lastFile = file;
+        w->files++;
+    }
+}
+
+/*
+ * This function counts every word of a file
+ */
+void countFile( const char *name, int file )
+{
+    FILE *in = fopen( name, "rb" );
+    unsigned char *data = NULL;
+    long size = 0, max = 0, i = 0;
+    size_t r;
+    char word[MAXWORDLEN + 4];
+    int length = 0, letters = 0;
+    if( in == NULL )
+    {
+        fprintf( stderr, "can't open %s\n", name );
+        exit( 1 );
+    }
+    do
+    {
+        if( size == max )
+        {
+            max = max ? max * 2 : 1 << 16;
+            data = realloc( data, max );
+        }
+        r = fread( data + size, 1, max - size, in );
+        size += r;
+    } while( r > 0 );
+    fclose( in );
+
+    while( i < size )
+    {
+        unsigned int c;
+        int n = decode( data + i, size - i, &c );
+        if( n > 0 && isLetter( c ) )
+        {
+            length = append( word, length, fold( c ) );
+            letters++;
+            i += n;
+            continue;
+        }
+        finish( word, length, letters, file );
+        length = letters = 0;
+        i += n > 0 ? n : 1;
+    }
+    finish( word, length, letters, file );
+    free( data );
+}
+
+/*
+ * This function marks the words of a stop list, one to a line
+ */
+void readStopWords( const char *name )
+{
+    FILE *in = fopen( name, "r" );
+    char line[256];
+    int j;
+    if( in == NULL )
+    {
+        fprintf( stderr, "can't open %s\n", name );
+        exit( 1 );
+    }
+    while( fgets( line, sizeof( line ), in ) )
+    {
+        if( line[0] == '#' )
+            continue;
+        for( j = 0; ( line[j] | 0x20 ) >= 'a' && ( line[j] | 0x20 ) <= 'z'; j++ )
+            line[j] |= 0x20;
+        line[j] = '\0';
+        if( j > 0 )
+            lookup( line )->stop = 1;
+    }
+    fclose( in );
+}
+
+int compare( const void *a, const void *b )
+{
+    const struct Word *x = *(struct Word* const*)a, *y = *(struct Word* const*)b;
+    if( x->count != y->count )
+        return x->count > y->count ? -1 : 1;
+    return strcmp( x->word, y->word );
+}
+
+int main( int argc, char *argv[] )
+{
+    int opt, f, k = 0;
+    long i;
+    while( ( opt = getopt( argc, argv, "k:s:" ) ) != -1 )
+    {
+        if( opt == 'k' )
+            k = atoi( optarg );
+        else if( opt == 's' )
+            readStopWords( optarg );
+        else
+        {
+            fprintf( stderr, "usage: %s [-k K] [-s stopwords.txt] file...\n",
+                     argv[0] );
+            return 1;
+        }
+    }
+    if( k <= 0 )
+        k = argc - optind;
+    for( f = optind; f < argc; f++ )
+        countFile( argv[f], f - optind );
+    qsort( words, numWords, sizeof( *words ), compare );
+    for( i = 0; i < numWords; i++ )
+        if( !words[i]->stop && words[i]->files >= k )
+            printf( "%s\t%ld\n", words[i]->word, words[i]->count );
+    return 0;
+}
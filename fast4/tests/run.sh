@@ -0,0 +1,241 @@
+#!/bin/sh
+#
+# Differential test and benchmark suite for fast4
+#
+# Builds fast4, a copy of it that cuts files into 4KB segments, the plain
+# single-threaded reference counter and the corpus generator, then checks
+# that every way fast4 can count prints exactly the reference's words and
+# counts (--all --format tsv) on generated and hand made corpora: chunk and
+# segment edges, words of 49 and 50 bytes, multi-byte letters, broken UTF-8,
+# empty and unterminated files. Each check is run both for words found in
+# every file and, with --min-files 1, in any file, and each --per-file list
+# against the reference's counts for that file alone. A run killed after its
+# first checkpoint is resumed and checked too, and a directory among the
+# files has to be skipped. Afterwards the reference and each backend are
+# timed on a bigger corpus and the speedups printed, then the three --table
+# backends against each other, on that corpus and on one of words sharing
+# long prefixes.
+# Exits non-zero if any check failed.
+#
+# usage: run.sh [-b MB] [-n]
+#   -b MB   size of the benchmark corpus, 48 by default
+#   -n      skip the benchmark
+#
+
+cd "$(dirname "$0")" || exit 1
+
+CC=${CC:-gcc}
+BENCHMB=48
+BENCH=1
+RUNS=3
+while getopts b:n opt; do
+    case $opt in
+        b) BENCHMB=$OPTARG ;;
+        n) BENCH= ;;
+        *) echo "usage: $0 [-b MB] [-n]" >&2; exit 1 ;;
+    esac
+done
+
+WORK=$(mktemp -d)
+FOLLOW=
+trap '[ -n "$FOLLOW" ] && kill $FOLLOW 2>/dev/null; rm -rf "$WORK"' EXIT
+C=$WORK/corpus
+mkdir "$C"
+
+$CC -O2 -pthread -o "$WORK/fast4" ../fast4.c || exit 1
+$CC -O2 -pthread -DSEGMENTSIZE=4096 -o "$WORK/fast4-seg" ../fast4.c || exit 1
+$CC -O2 -o "$WORK/reference" reference.c || exit 1
+$CC -O2 -o "$WORK/gencorpus" gencorpus.c || exit 1
+
+# prints $1 $2 times
+rep() {
+    i=0
+    while [ "$i" -lt "$2" ]; do
+        printf "$1"
+        i=$((i + 1))
+    done
+}
+
+G=$WORK/gencorpus
+$G ascii 3000000 1 > "$C/ascii1"
+$G ascii 2000000 2 > "$C/ascii2"
+$G ascii 1000000 3 > "$C/ascii3"
+$G utf8 2000000 4 > "$C/utf8a"
+$G utf8 1500000 5 > "$C/utf8b"
+$G long 1000000 6 > "$C/long"
+$G edges 500000 7 > "$C/edges"
+$G prefix 1500000 8 > "$C/prefix"
+: > "$C/empty"
+printf 'Unterminated' > "$C/unterminated"
+printf '..., -- 123 ;;\n' > "$C/separators"
+# 49 bytes counts and 50 does not, in letters of one byte and of two
+{
+    rep a 49; printf ' '; rep b 50; printf '\n'
+    rep '\303\251' 24; printf 'x '; rep '\303\251' 25; printf ' '
+    rep c 49
+} > "$C/limits"
+
+# name, then the corpus files
+SETS="ascii:ascii1 ascii2 ascii3
+utf8:utf8a utf8b
+long:long
+edges:edges
+prefix:prefix
+limits:limits
+mixed:ascii3 utf8b long edges limits prefix
+empty:empty
+with-empty:ascii2 empty
+tiny:unterminated separators limits"
+
+# name | fast4 binary and flags | reference flags
+BACKENDS="threads|fast4 --threads 4 --chunk 61|
+threads-4k|fast4 --threads 3 --chunk 4096|
+tuned|fast4|
+open|fast4 --table open --threads 3 --chunk 500|
+art|fast4 --table art --threads 3 --chunk 500|
+art-4k|fast4-seg --table art --threads 2 --chunk 100|
+segments|fast4-seg --threads 2 --chunk 100|
+numa|fast4 --numa --threads 5|
+numa-4k|fast4-seg --numa --threads 3|
+procs|fast4 --procs 3 --threads 2|
+procs-4k|fast4-seg --procs 2|
+stopwords|fast4 --stopwords --threads 2 --chunk 333|-s ../stopwords.txt"
+
+FAILED=0
+PASSED=0
+
+# compares fast4's output in $WORK/got with the reference's in $WORK/want
+check() {
+    if cmp -s "$WORK/got" "$WORK/want"; then
+        PASSED=$((PASSED + 1))
+    else
+        FAILED=$((FAILED + 1))
+        echo "FAIL $1"
+        diff "$WORK/got" "$WORK/want" | head -5
+    fi
+}
+
+while IFS=: read -r set files; do
+    paths=
+    for f in $files; do
+        paths="$paths $C/$f"
+    done
+    while IFS='|' read -r name cmd refflags; do
+        for min in "" 1; do
+            "$WORK"/$cmd --all --format tsv ${min:+--min-files $min} $paths \
+                > "$WORK/got"
+            "$WORK/reference" $refflags ${min:+-k $min} $paths > "$WORK/want"
+            check "$name on $set${min:+ with --min-files $min}"
+        done
+    done <<EOF
+$BACKENDS
+EOF
+done <<EOF
+$SETS
+EOF
+
+# --follow counts what is appended while it runs; its last window should
+# hold everything
+: > "$C/follow"
+"$WORK/fast4" --follow --window 60 --all --format json "$C/follow" \
+    > "$WORK/follow.out" &
+FOLLOW=$!
+sleep 1
+cat "$C/ascii3" "$C/utf8b" "$C/limits" >> "$C/follow"
+printf '\n' >> "$C/follow"
+sleep 3
+kill $FOLLOW
+wait $FOLLOW 2>/dev/null
+FOLLOW=
+tail -n 1 "$WORK/follow.out" |
+    sed 's/^{"words":\[//; s/\]}$//; s/},{/}\n{/g' |
+    sed -n 's/^{"word":"\(.*\)","count":\([0-9]*\)}$/\1\t\2/p' > "$WORK/got"
+"$WORK/reference" "$C/follow" > "$WORK/want"
+check "follow"
+
+# a run checkpointing at every 4KB segment is killed once its first
+# snapshot is on disk, and the run resumed from it should count the same as
+# one that never stopped
+CKFILES="$C/ascii1 $C/ascii2 $C/utf8a $C/utf8b $C/long $C/prefix"
+"$WORK/fast4-seg" --checkpoint "$WORK/checkpoint" --checkpoint-every 0 \
+    --min-files 1 $CKFILES > /dev/null &
+CKPID=$!
+while [ ! -f "$WORK/checkpoint" ] && kill -0 $CKPID 2>/dev/null; do
+    :
+done
+kill -9 $CKPID 2>/dev/null
+wait $CKPID 2>/dev/null
+"$WORK/fast4-seg" --checkpoint "$WORK/checkpoint" --resume --all --format tsv \
+    --min-files 1 $CKFILES > "$WORK/got"
+"$WORK/reference" -k 1 $CKFILES > "$WORK/want"
+check "checkpoint and resume"
+
+# each --per-file list ranks a file's words by their count in that file, so
+# it should be the start of the reference's counts for the file alone
+for args in "" "--numa" "--procs 2" "--table art --threads 3 --chunk 500"; do
+    "$WORK/fast4" --per-file --format tsv $args "$C/ascii1" "$C/utf8a" "$C/long" \
+        > "$WORK/perfile"
+    for f in ascii1 utf8a long; do
+        awk -F '\t' -v f="$C/$f" '$1 == f { print $2 "\t" $3 }' "$WORK/perfile" \
+            > "$WORK/got"
+        "$WORK/reference" "$C/$f" | head -n "$(wc -l < "$WORK/got")" > "$WORK/want"
+        check "per-file${args:+ $args} on $f"
+    done
+done
+
+# a directory can't be read, so it is skipped with a message and the other
+# files still counted
+for args in "" "--numa" "--procs 2"; do
+    "$WORK/fast4" --all --format tsv --min-files 1 $args "$C/ascii3" "$C" \
+        > "$WORK/got" 2> /dev/null
+    "$WORK/reference" -k 1 "$C/ascii3" > "$WORK/want"
+    check "directory argument${args:+ with $args}"
+done
+
+echo "$PASSED passed, $FAILED failed"
+
+if [ -n "$BENCH" ]; then
+    part=$((BENCHMB * 1024 * 1024 / 3))
+    $G ascii $part 11 > "$C/bench1"
+    $G utf8 $part 12 > "$C/bench2"
+    $G ascii $part 13 > "$C/bench3"
+    BENCHFILES="$C/bench1 $C/bench2 $C/bench3"
+
+    # prints the best of $RUNS wall clock times of a command, in seconds
+    best() {
+        i=0
+        while [ $i -lt $RUNS ]; do
+            start=$(date +%s.%N)
+            "$@" > /dev/null
+            end=$(date +%s.%N)
+            echo "$start $end"
+            i=$((i + 1))
+        done | awk '{ t = $2 - $1; if (NR == 1 || t < b) b = t }
+                    END { printf "%.3f", b }'
+    }
+
+    echo "benchmark: ${BENCHMB}MB in 3 files, best of $RUNS"
+    base=$(best "$WORK/reference" $BENCHFILES)
+    printf '%-10s %8ss\n' reference "$base"
+    cpus=$(getconf _NPROCESSORS_ONLN)
+    while IFS='|' read -r name flags; do
+        t=$(best "$WORK/fast4" $flags $BENCHFILES)
+        printf '%-10s %8ss %7sx\n' "$name" "$t" \
+            "$(echo "$base $t" | awk '{ printf "%.1f", ( $2 > 0 ? $1 / $2 : 0 ) }')"
+    done <<EOF
+threads|
+numa|--numa
+procs|--procs $cpus
+EOF
+
+    $G prefix $((BENCHMB * 1024 * 1024)) 14 > "$C/bench4"
+    for corpus in "words|$BENCHFILES" "prefixes|$C/bench4"; do
+        echo "tables on ${corpus%%|*}"
+        for table in hash open art; do
+            printf '%-10s %8ss\n' "$table" \
+                "$(best "$WORK/fast4" --table $table ${corpus#*|})"
+        done
+    done
+fi
+
+[ "$FAILED" -eq 0 ]
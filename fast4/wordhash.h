@@ -0,0 +1,42 @@
+//  wordhash.h
+//  fast4
+//
+//  Key hashing shared by fast4 and the stop word table generator, so the
+//  perfect hash built ahead of time agrees with the hash the tokenizer
+//  computes.
+//
+
+#ifndef WORDHASH_H
+#define WORDHASH_H
+
+#include <stdint.h>
+
+/*
+ * This is a hash function that mixes a key one 64-bit lane at a time
+ */
+static inline unsigned int hash( const uint64_t *key, int words )
+{
+    uint64_t hash = 0;
+    int i;
+    for( i = 0; i < words; i++ )
+        hash = ( hash ^ key[i] ) * 0x9e3779b97f4a7c15ULL;
+    
+    return (unsigned int)( hash >> 32 );
+}
+
+/*
+ * This function returns the number of 64-bit lanes in a key of the given
+ * length: 1, 2, 4 or 8
+ */
+static inline int keyWords( int length )
+{
+    if( length <= 8 )
+        return 1;
+    if( length <= 16 )
+        return 2;
+    if( length <= 32 )
+        return 4;
+    return 8;
+}
+
+#endif